@@ -44,6 +44,7 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
 #include <limits.h>
@@ -52,13 +53,17 @@
 #include <pwd.h>
 #include <grp.h>
 
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__) || defined(__sun__)
+#    define HAVE_GETOPT_LONG
+#    include <getopt.h>
+#endif
 #if defined(__hpux)
 #   include <sys/pstat.h>
 #endif
 
 #if defined (__sun__)
 #    include <sys/statvfs.h>
-#elif defined(__hpux)
+#elif defined(__hpux) || defined(__linux__)
 #    include <sys/vfs.h>
 #elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
 #    include <sys/param.h>
@@ -69,26 +74,164 @@
 #undef TRUE
 typedef enum {FALSE, TRUE} boolean;
 
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+#    define DIRENT_TYPE(dent)	((dent)->d_type)
+#else
+#    define DIRENT_TYPE(dent)	0	// - no d_type in struct dirent, handle_dirent() doesn't use it
+#endif
+
 #if defined (__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-#    include <fcntl.h>
 #    include <sys/syscall.h>
+#    if defined(__linux__) && ! defined(IOPRIO_CLASS_SHIFT)	// - from linux/ioprio.h, not always installed
+#        define IOPRIO_CLASS_SHIFT	13
+#        define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+#        define IOPRIO_CLASS_BE	2
+#        define IOPRIO_CLASS_IDLE	3
+#        define IOPRIO_WHO_PROCESS	1
+#    endif
 #    define DEFAULT_DIRENT_COUNT 100000		// - for option -X, may be overridden using env var DIRENTS
+#    define DENTS_MIN_SIZE	(32*1024)	// - smallest getdents buffer, used for small directories
+#    if defined(__linux__)
+    static boolean extreme_readdir = TRUE; 	// - getdents64() is the default on Linux, env var DIRENTS=0 selects readdir()
+    // This is what the kernel returns from getdents64(), and is handed directly to handle_dirent():
+    struct linux_dirent64 {
+	unsigned long long	 d_ino;
+	long long		 d_off;
+	unsigned short		 d_reclen;
+	unsigned char		 d_type;
+	char			 d_name[];
+    };
+    typedef struct linux_dirent64 kernel_dirent_t;
+#    else
     static boolean extreme_readdir = FALSE; 	// - set to TRUE if option -X is given
-    static unsigned buf_size;			// - set if option -X is given
-    static unsigned getdents_calls;		// - incremented for every syscall(SYS_getdents, ... (if option -X is given)
+    typedef struct dirent kernel_dirent_t;
+#    endif
+    static unsigned buf_size;			// - max size of a getdents buffer, set if option -X is given (or by default on Linux)
+
+    typedef struct dentsbuf {
+	char		*buf;
+	unsigned	 size;			// - allocated size of buf
+	unsigned	 want;			// - number of bytes to read into buf for the current directory
+    } dentsbuf_t;
+#endif
+
+// io_uring is used through raw system calls, since liburing is not always installed (option --io-uring).
+// IORING_FEAT_CUR_PERSONALITY came with Linux 5.6, along with IORING_OP_STATX and IORING_OP_OPENAT.
+#if defined(__linux__) && defined(STATX_TYPE) && defined(SYS_io_uring_setup) && defined(__has_include)
+#    if __has_include(<linux/io_uring.h>)
+#        include <linux/io_uring.h>
+#        if defined(IORING_FEAT_CUR_PERSONALITY)
+#            include <sys/mman.h>
+#            include <sys/sysmacros.h>
+#            define HAVE_IO_URING
+#        endif
+#    endif
+#endif
+
+#if defined(HAVE_IO_URING)
+// The rings of a thread's io_uring instance, mmap'ed from the kernel.
+typedef struct uring {
+	int		 state;			// - URING_UNTRIED, URING_READY or URING_FAILED
+	int		 fd;
+	unsigned	 entries;		// - size of the submission ring
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void		*sq_ptr, *cq_ptr;
+	size_t		 sq_len, cq_len, sqes_len;
+	unsigned	 inflight;		// - requests submitted and not reaped yet
+	unsigned	 unsubmitted;		// - requests put in the submission ring, but not handed to the kernel yet
+} uring_t;
+#    define URING_UNTRIED	0
+#    define URING_READY		1
+#    define URING_FAILED	2
+#endif
+
+// An entry stat'ed, and a subdirectory possibly opened, ahead of being handled (option --io-uring).
+// The results are filled in by uring_reap(), so the slot must stay put while requests are in flight.
+typedef struct prefetch {
+#if defined(HAVE_IO_URING)
+	struct statx	 stx;
 #endif
+	int		 stat_res;		// - result of the statx request: 0 or -errno
+	int		 open_res;		// - result of the openat request: the descriptor or -errno, -1 if none was made
+	unsigned	 pending;		// - number of requests in flight
+	boolean		 stat_made;		// - set if a statx request was made for the entry
+	char		*path;			// - the whole path of the entry, without option -A
+	unsigned	 path_size;		// - allocated size of path
+} prefetch_t;
+
+// An entry buffered to be handled in inode order (option -O).
+typedef struct inoent {
+	unsigned long long ino;
+	unsigned	 name;			// - offset in entbuf_t.names of the d_type byte, followed by the name
+} inoent_t;
+
+// Entries of a directory buffered for sorting on inode number (option -O), or to be stat'ed ahead (option --io-uring),
+// one per level of in-line processing.
+typedef struct entbuf {
+	inoent_t	*ents;
+	inoent_t	*tmp;			// - scratch space for inode_sort()
+	unsigned	 cnt;			// - number of entries buffered
+	unsigned	 size;			// - allocated number of entries in ents and tmp
+	char		*names;
+	unsigned	 names_len;
+	unsigned	 names_size;		// - allocated size of names
+	prefetch_t	*pf;			// - uring_depth slots, entry i uses slot i % uring_depth (option --io-uring)
+} entbuf_t;
 
 // Borrowed from /usr/include/nspr4/pratom.h on RH6.4:
 #if ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)) && ! defined(__hppa__)
 #    define PR_ATOMIC_ADD(ptr, val) __sync_add_and_fetch(ptr, val)
-#else
-     static pthread_mutex_t accum_filecnt_lock = PTHREAD_MUTEX_INITIALIZER; // for protecting "accum_filecnt"
+#endif
+
+#if defined(__linux__) && defined(PR_ATOMIC_ADD)
+#    include <linux/futex.h>
+#    define USE_FUTEX		// - idle threads are parked on a futex, see dirlist_pull_dir()
 #endif
 
 #define INLINE_PROCESSING_THRESHOLD	2
+#define INLINE_PLENTY_PER_THREAD	64	// - with more queued directories per active thread, all subdirs are processed in-line
+#define INLINE_MAX_LEVEL		64	// - max levels of in-line processing beyond option -I, see inline_wanted()
 
 #define MAX_THREADS        	512	// - max number of threads that may be created
 
+#define CACHELINE_SIZE		64	// - per-thread data is padded to this size to avoid false sharing
+
+#define SLAB_SIZE		(256*1024) // - dirlist_t nodes are carved out of per-thread slabs of this size
+#define SLAB_CLASS_SIZE		64	// - node sizes are rounded up to a multiple of this
+#define SLAB_CLASSES		16	// - nodes larger than SLAB_CLASSES*SLAB_CLASS_SIZE are malloc'ed individually
+#define PATHBUF_SIZE		8192	// - initial size of the per-thread path buffer, grows if needed
+#define AUTO_TUNE_USEC		500000	// - how often the number of active threads is tuned with -t auto
+#define AUTO_MAX_STEP		16	// - max number of threads added or removed in one go with -t auto
+#define RATE_BURST_NSEC		100000000ULL // - with option -b, at most 0.1 s worth of unused ops may be saved up
+#define RATE_CHUNK_MAX		64	// - max number of ops taken from the budget of option -b in one go
+#define BACKGROUND_NICE		10	// - nice increment with option -b
+#define IDLE_BUCKETS		256	// - size of the per-thread histogram of idle time over the run (option -S)
+#define IDLE_BUCKET_USEC	1000	// - initial width of a bucket, doubled each time the run outgrows the histogram
+#define DEFAULT_CHECKPOINT_INTERVAL 300	// - seconds between checkpoints (option -C), may be changed with --checkpoint-interval
+#define CHECKPOINT_MAGIC	"chowntree checkpoint 1" // - first record of a checkpoint file
+#define OPTSTRING		"hb:t:I:B:e:E:Zfdm:nluv:xqQPWOAC:R:D:s:M:STVX"
+#define OPT_CHECKPOINT_INTERVAL	256	// - long option only
+#define OPT_DEPTH_WEIGHT	257	// - long option only
+#define OPT_IDLE_IO		258	// - long option only
+#define OPT_DEV_THREADS		259	// - long option only
+#define OPT_MAX_QUEUED		260	// - long option only
+#define OPT_CHOWN_THREADS	261	// - long option only
+#define OPT_IO_URING		262	// - long option only
+#define OPT_HARDLINK_MEMORY	263	// - long option only
+#define OPT_EXCLUDE_FROM	264	// - long option only
+#define DEFAULT_BATCH_THRESHOLD	100000	// - directories with more entries are split into batches for other threads (option -B)
+#define BATCH_BUF_SIZE		(64*1024) // - initial size of the packed entries of a batch, grows if needed
+#define INODE_ORDER_CHUNK	65536	// - max number of entries sorted on inode number in one go (option -O)
+#define INODE_ORDER_MIN		1024	// - initial number of entries in a sort buffer, grows up to INODE_ORDER_CHUNK
+#define PREFETCH_CHUNK		4096	// - max number of entries buffered in one go for option --io-uring without -O
+#define CHOWN_RING_SIZE		64	// - batches of entries each thread may have waiting for the chown threads (option --chown-threads)
+#define CHOWN_BATCH_BYTES	(16*1024) // - size of such a batch
+#define HARDLINK_STRIPE_BITS	6	// - the hard link set (option -l) is split in 1 << HARDLINK_STRIPE_BITS stripes, each with a lock
+#define HARDLINK_MIN_SLOTS	256	// - initial size of a stripe, doubled when it is 3/4 full
+
 #define DIRTY_CONSTANT		~0 	// - for handling non-POSIX compliant file systems
 			   		// (link count should reflect the number of subdirectories, and should be 2 for empty directories)
 
@@ -96,37 +239,112 @@ typedef enum {FALSE, TRUE} boolean;
 
 static char *progname;
 static boolean xdev = FALSE;		// - set to TRUE if option -x is given
+#if defined(AT_SYMLINK_NOFOLLOW) // - POSIX.1-2008 *at() system calls are available
+static boolean at_calls = FALSE;	// - set to TRUE if option -A is given
+#endif
 
 static boolean master_finished = FALSE;
 
-static unsigned statcount = 0; // - counter for lstat calls
-#if ! defined(PR_ATOMIC_ADD)
-	static pthread_mutex_t statcount_lock = PTHREAD_MUTEX_INITIALIZER;
-#endif
+static char *checkpoint_file = NULL;	  // - set if option -C is given, or implied by -R
+static char *checkpoint_tmpfile = NULL;	  // - checkpoint_file is written to this file first, and then renamed
+static unsigned checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+static unsigned checkpoints_written = 0;
+static time_t next_checkpoint = 0;	  // - when the next checkpoint is due
+static time_t deadline = 0;		  // - set if option -D is given
+static volatile sig_atomic_t stop_requested = 0; // - signal number, or -1 when the deadline is reached
+static boolean stopping = FALSE;	  // - tells the threads to leave everything unfinished for the final checkpoint
 
-#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
-	unsigned statcount_unexp = 0;
-#	if ! defined(PR_ATOMIC_ADD)
-		static pthread_mutex_t statcount_unexp_lock = PTHREAD_MUTEX_INITIALIZER;
-#	endif
-#endif
+static unsigned *resume_set = NULL;	  // - hash set of the directories queued from the checkpoint given with -R, index+1 into:
+static char **resume_paths = NULL;	  // - their paths
+static off_t *resume_pos = NULL;	  // - and where to continue reading them
+static unsigned resume_set_mask = 0;	  // - size of resume_set minus 1
+static unsigned resume_count = 0;	  // - number of directories in resume_set
+typedef struct resume_batch {
+	char		*dirpath;
+	unsigned	 depth;
+	char		*entries;	  // - as saved in the checkpoint, d_type+'A' and the name for each entry
+	unsigned	 len;
+} resume_batch_t;
+static resume_batch_t *resume_batches = NULL; // - batches of entries (option -B) saved in the checkpoint
+static unsigned resume_batch_count = 0;
 
-static unsigned queued_dirs = 0;	// - the total number of dirs handled by a separate thread
-#if ! defined(PR_ATOMIC_ADD)
-	static pthread_mutex_t queued_dirs_lock = PTHREAD_MUTEX_INITIALIZER;
-#endif
+static time_t since = 0;		  // - set if option -s is given: directories not changed since then are not re-examined
+static char *stampfile = NULL;		  // - the stamp file given with -s, if not just a time
+static time_t run_start = 0;		  // - when the run started, written to the stamp file when it completes
 
-static boolean simulate_posix_compliance = FALSE; // - POSIX requires the directory link count to be at least 2
+// POSIX requires the directory link count to be 2 plus the number of subdirectories, which is used to process directories
+// without subdirectories in-line and to skip unchanged ones (option -s). Whether a file system keeps it is found per file
+// system by devfs_posix(), and a directory on a file system which doesn't, gets the link count DIRTY_CONSTANT.
+typedef struct devfs {
+	unsigned long	 st_dev;	  // - File system id.
+	boolean		 posix;		  // - Set if the file system keeps POSIX link counts on directories.
+} devfs_t;
+static devfs_t *devfs_arr = NULL;
+static unsigned devfs_cnt = 0;		  // - number of file systems seen so far
+static unsigned devfs_size = 0;		  // - allocated size of devfs_arr
+static pthread_mutex_t devfs_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting devfs_arr, devfs_cnt, devfs_size
 
 static unsigned char inline_processing_threshold = INLINE_PROCESSING_THRESHOLD;
+static unsigned max_queued = 0;		  // - option --max-queued: beyond this many queued directories, subdirs are processed in-line
+static unsigned batch_threshold = DEFAULT_BATCH_THRESHOLD; // - may be changed with option -B, 0 disables splitting of directories
 
 static boolean lifo_queue = TRUE;       // - default queue of directories to be processed is of type LIFO
 static boolean fifo_queue = FALSE;      // - select a standard FIFO queue with option -q
-static boolean ino_queue = FALSE;       // - select a sorted queue of dirents with option -Q
-static unsigned long inolist_bypasscount;// - total number of list elements bypassed; only used by inodirlist_bintreeinsert() 
+static boolean heap_queue = FALSE;      // - select a heap of directories with option -Q (ordered on inode) or -P
+static boolean prio_queue = FALSE;      // - order the heap on the number of subdirectories instead, option -P
+static unsigned depth_weight = 0;       // - option --depth-weight, see dirlist_priority()
+static boolean ws_queue = FALSE;        // - select per-thread work-stealing deques with option -W
+static unsigned dev_threads = 0;        // - option --dev-threads: one queue per file system, and max threads busy on each
+static boolean inode_order = FALSE;     // - handle the entries of each directory in inode order, option -O
+static unsigned uring_depth = 0;        // - option --io-uring: max number of entries stat'ed ahead by each thread, 0 if not used
+static boolean uring_unavailable = FALSE; // - set when io_uring (or statx/openat through it) is not supported by the kernel
+static boolean entbuf_used = FALSE;     // - entries are buffered by entbuf_add(), with option -O or --io-uring
+static unsigned entbuf_chunk = INODE_ORDER_CHUNK; // - max number of entries buffered in one go
+
+// With option --chown-threads, the threads reading the directories hand the entries to be chown()'ed in batches to a pool
+// of chown threads, through a ring per reading thread. The chown threads have the entries after the main thread in threadlocal_arr.
+static unsigned	 chown_threads = 0;	  // - option --chown-threads: size of the pool of chown threads, 0 for no pipeline
+static pthread_t *chown_arr = NULL;
+static pthread_mutex_t chown_lock = PTHREAD_MUTEX_INITIALIZER; // - for sleeping on chown_work_cond and chown_room_cond
+static pthread_cond_t chown_work_cond = PTHREAD_COND_INITIALIZER; // - a batch was handed off, or the run is finished
+static pthread_cond_t chown_room_cond = PTHREAD_COND_INITIALIZER; // - a batch was taken from a ring
+static volatile unsigned chown_sleepers = 0;   // - chown threads waiting on chown_work_cond
+static volatile unsigned chown_room_waiters = 0; // - reading threads waiting on chown_room_cond
+static volatile unsigned chown_pending = 0;    // - batches waiting in all rings
+static unsigned	 chown_pending_peak = 0;  // - for option -S
+static volatile boolean chown_finished = FALSE; // - set when all directories are read, so the chown threads quit once the rings are empty
+static unsigned long long chown_end_usec = 0; // - when the last chown thread was done, in microseconds since run_t0
+static struct chownbatch *chownbatch_live = NULL; // - batches handed off and not chown()'ed yet, for checkpoint_write() (option -C)
+static pthread_mutex_t chownbatch_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting chownbatch_live
+
+// With option -l, files with more than one link are recorded in a hash set on (st_dev, st_ino), and only changed through the
+// first link found. The set is split in stripes with a lock each, picked by the hash, so the threads rarely contend for a lock.
+// A file is dropped from the set again once all its links are seen, and --hardlink-memory bounds the size of the set.
+typedef struct hardlink {
+	dev_t		 st_dev;
+	ino_t		 st_ino;
+	unsigned	 links_left;	  // - links of the file not seen yet, 0 for a free slot
+} hardlink_t;
+typedef struct hardlink_stripe {
+	pthread_mutex_t	 lock;		  // - for protecting the rest of the stripe
+	hardlink_t	*slots;		  // - open addressing with linear probing, NULL until a file is recorded in the stripe
+	unsigned	 mask;		  // - number of slots minus 1
+	unsigned	 count;		  // - number of files recorded
+} __attribute__((aligned(CACHELINE_SIZE))) hardlink_stripe_t;
+static boolean	 hardlinks = FALSE;	  // - set if option -l is given
+static unsigned	 hardlink_max_slots = 0;  // - max number of slots per stripe from --hardlink-memory, 0 for no limit
+static hardlink_stripe_t hardlink_set[1 << HARDLINK_STRIPE_BITS];
 
 static boolean debug = FALSE;		// - set if env var DEBUG is set
 
+enum inline_reason {			  // - see inline_wanted()
+	INLINE_NO,			  // - queue the subdir
+	INLINE_STARVING,		  // - queue the subdir, though option -I would process it in-line, since threads are idle
+	INLINE_BASE,			  // - process the subdir in-line, as given by option -I
+	INLINE_PLENTY,			  // - process the subdir in-line, since the queue holds plenty of work already
+	INLINE_FORCED			  // - process the subdir in-line, since --max-queued is reached
+};
+
 enum filetype {
 	FILETYPE_REGFILE=1,
 	FILETYPE_DIR=2,
@@ -138,47 +356,167 @@ enum filetype {
 };
 static unsigned filetypemask = 0;	  // - set if option -f, -d is specified
 
-static unsigned accum_filecnt = 0;	  // - count the number of files seen
 static unsigned verbose_count = 0;	  // - set if option -v is specified
-static unsigned last_accum_filecnt = 0;   // - used by -v
-static pthread_mutex_t last_accum_filecnt_lock = PTHREAD_MUTEX_INITIALIZER; // for protecting "accum_filecnt"
-static time_t last_t = 0;                 // - previous timestamp in seconds since EPOCH, used in pthread_routine()
-
-static boolean just_count = FALSE;        // - set if -w, -z, -D, -R is specified
+static unsigned long long last_entries = 0; // - used by -v
+static time_t last_t = 0;                 // - previous timestamp in seconds since EPOCH, used by progress_report()
 
-static char **excludelist;		  // - set if -e/-E is specified
-static unsigned excludelist_count = 0;	  // - set if -e/-E is specified
-static regex_t **excluderecomp;		  // - set if -e/-E is specified
+// The exclusion rules of options -e, -E, -Z and --exclude-from are compiled by exclude_build() once all are given:
+// the names into a hash set, the regular expressions into a single one, and the full paths into a trie of path components.
+typedef struct exclude_node {
+	const char	*name;		  // - Component of the path, not terminated, points into exclude_paths.
+	unsigned	 name_len;
+	boolean		 excluded;	  // - Set if a rule ends here, which excludes the directory and everything below it.
+	struct exclude_node *children;	  // - Sorted on name.
+	unsigned	 child_count;
+} exclude_node_t;
+static char **exclude_names = NULL;	  // - directory names to skip (-E, -Z)
+static unsigned exclude_names_count = 0;
+static unsigned *exclude_name_set = NULL; // - hash set of exclude_names, index+1 into it
+static unsigned exclude_name_mask = 0;	  // - size of exclude_name_set minus 1
+static char **exclude_patterns = NULL;	  // - regular expressions for directory names to skip (-e)
+static regex_t **exclude_recomps = NULL;  // - each of them compiled, used if they can't be combined, and for debug output
+static unsigned exclude_patterns_count = 0;
+static regex_t *exclude_regex = NULL;	  // - all exclude_patterns combined into one, so a name is matched in a single pass
+static char **exclude_paths = NULL;	  // - full paths of directories to skip (-E with a /)
+static unsigned exclude_paths_count = 0;
+static exclude_node_t exclude_trie;	  // - root of the trie of exclude_paths
+static boolean excluding = FALSE;	  // - set if there is any exclusion rule
 
 boolean dryrun = FALSE; 		  // - set to TRUE if -n is specified; don't delete anything; just print files/dirs to be deleted
 
-static unsigned entries_chowned = 0;	  // - total number of files/dirs chown()'ed.
-#if ! defined(PR_ATOMIC_ADD)
-	static pthread_mutex_t entries_chowned_lock = PTHREAD_MUTEX_INITIALIZER;
+static boolean skip_unchanged = FALSE;	  // - set to TRUE if option -u is given
+#if defined(STATX_UID)
+static boolean statx_unsupported = FALSE; // - set if the kernel returns ENOSYS for statx()
 #endif
 
-static unsigned file_no_access = 0;       // - counter for unsuccessful chown() calls, type EEXIST
-static unsigned file_not_found = 0;       // - counter for unsuccessful chown() calls, type ENOENT
-static unsigned file_any_other_error = 0; // - counter for unsuccessful chown() calls, type "any other reason"
 static uid_t new_uid = 0;
 static gid_t new_gid = 0;
 
+// One mapping in the ownership map file (option -M): ids first .. last are mapped to new_first .. new_first + last - first.
+typedef struct idmap_range {
+	unsigned long	 first;
+	unsigned long	 last;
+	unsigned long	 new_first;
+	unsigned	 line;		    // - Line number in the map file.
+} idmap_range_t;
+
+// All uid or all gid mappings. Single ids are found through a hash table, and real ranges by binary search.
+typedef struct idmap {
+	idmap_range_t	*ranges;	    // - All mappings, in map file order.
+	unsigned	 count;
+	unsigned	*hash;		    // - Open addressing hash table of the single id mappings, index+1 into ranges.
+	unsigned	 hash_mask;
+	unsigned	*intervals;	    // - The real ranges, as indexes into ranges, sorted on first.
+	unsigned	 interval_count;
+} idmap_t;
+
+static char *map_file = NULL;		  // - set if option -M is given, replacing the [user][:group] argument
+static unsigned long long map_hash = 0;	  // - hash of the contents of map_file, saved in the stamp file and checkpoint, 0 without -M
+static idmap_t uid_map, gid_map;
+
 static pthread_mutex_t perror_lock = PTHREAD_MUTEX_INITIALIZER; // The perror() function should be allowed to finish printing.
 
+// A directory being split into batches (option -B). It is shared by the thread reading the directory and all of its batches,
+// and whoever drops the last reference chowns the directory itself.
+typedef struct dirshare {
+	unsigned	 refcnt;	    // - One for the thread reading the directory, plus one per queued batch.
+	uid_t		 st_uid;	    // - User ID of the directory's owner
+	gid_t		 st_gid;	    // - Group ID of the directory's group
+	int		 dirfd;		    // - dup() of the open directory with option -A, else -1
+	char		 dirpath[];
+} dirshare_t;
+
+// A batch of entries read from a split directory, queued and processed like a directory of its own.
+typedef struct dirbatch {
+	dirshare_t	*share;
+	unsigned	 cnt;		    // - Number of entries.
+	unsigned	 len;		    // - Number of bytes used in entries.
+	unsigned	 size;		    // - Allocated size of entries.
+	char		 entries[];	    // - For each entry: d_type, followed by the nul-terminated name.
+} dirbatch_t;
+
+// A directory with entries handed to the chown threads (option --chown-threads). It is shared by the thread
+// reading the directory and all the batches of entries handed off from it, and freed by whoever drops the last reference.
+typedef struct chowndir {
+	unsigned	 refcnt;	    // - One for the thread reading the directory, plus one per batch not chown()'ed yet.
+	int		 dirfd;		    // - dup() of the open directory with option -A, else -1
+	unsigned	 depth;
+	unsigned	 dirpath_len;
+	char		 dirpath[];
+} chowndir_t;
+
+// A batch of entries to be chown()'ed by a chown thread (option --chown-threads). With option -C, it is on the list of
+// chownbatch_live from the hand-off until it is done, so a checkpoint saves its entries, see checkpoint_add_chowns().
+typedef struct chownbatch {
+	chowndir_t	*dir;
+	struct chownbatch *prev;	    // - On the list of chownbatch_live (option -C).
+	struct chownbatch *next;
+	unsigned	 cnt;		    // - Number of entries.
+	unsigned	 len;		    // - Number of bytes used in entries.
+	char		 entries[CHOWN_BATCH_BYTES]; // - For each entry: new uid, new gid, d_type, followed by the nul-terminated name.
+} chownbatch_t;
+// A checkpoint (option -C) is a sequence of nul-terminated records: CHECKPOINT_MAGIC, "<uid>:<gid>:<start time>" of the run,
+// followed by ":<map hash>" with option -M, and then one record per directory left to process, "<type><depth>:<position>:<path>". The type is Q for a directory
+// still in the queue, or P for one that was partially processed, where position is where to continue reading it
+// (the d_off of the last entry handled, with getdents64 on Linux), or 0 to process it all over again.
+// Entries read from a split directory (option -B) but not handled yet are saved as "B<depth>:<count>:<path>",
+// followed by one record per entry, d_type+'A' and then the name.
+typedef struct checkpoint_buf {
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+	unsigned	 dirs;		    // - Number of directory records.
+} checkpoint_buf_t;
+
+#if ! defined(PR_ATOMIC_ADD)
+	static pthread_mutex_t dirshare_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting dirshare_t.refcnt
+#endif
+
+typedef struct pathnode pathnode_t;
+
+// The path of a directory with queued subdirectories, shared by all of them. Each queued directory just stores its own name,
+// and its full path is built in the thread's path buffer when it is processed, see path_build().
+struct pathnode {
+	pathnode_t	*parent;	    // - The parent directory, or NULL if name is the whole path (a start point or a split directory).
+	unsigned	 refcnt;	    // - One for the directory itself while it is processed, plus one per queued subdirectory or child pathnode_t.
+	unsigned	 len;		    // - Length of the whole path.
+	unsigned	 name_len;	    // - strlen(name)
+	unsigned char	 slabclass;	    // - Size class, see slab_alloc().
+	char		 name[];	    // - The last component of the path.
+};
+
+#if ! defined(PR_ATOMIC_ADD)
+	static pthread_mutex_t pathnode_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting pathnode_t.refcnt
+#endif
+
 typedef struct dirlist dirlist_t;
 
 struct dirlist {
-	char		*dirpath;
+	char		*name;		    // - Last component of the path, stored right after the node itself, or the whole path if parent is NULL.
+				    	    //   NULL if processed in-line, since the path is in the thread's path buffer already.
+	unsigned	 name_len;	    // - strlen(name), also set if processed in-line.
+	unsigned	 dirpath_len;	    // - Length of the whole path.
+	pathnode_t	*parent;	    // - The path of the parent directory (a reference is held), NULL for a start point or a batch.
+	pathnode_t	*pnode;		    // - The path of this directory, once it has queued a subdirectory, see dir_pathnode().
+	dirlist_t	*inline_parent;	    // - The directory being processed, if this one is processed in-line.
+	unsigned char	 slabclass;	    // - Size class of the node, SLAB_CLASSES if it was malloc'ed individually.
 	unsigned	 depth;		    // - Current directory depth.
 	unsigned	 inlined;  	    // - How many subdirs are processed inline so far.
+	unsigned	 subdirs;	    // - How many subdirs are found so far - the rest are no directories once st_nlink - 2 are found.
 	unsigned	 filecnt;    	    // - Number of files in this dir.
 	dirlist_t	*next;	    	    // - A pointer to next directory in queue.
 	dirlist_t       *prev;              // - pointer to previous directory in queue
  	unsigned	 st_nlink;	    // - Link count for current directory = number of subdirs incl "." and "..".
+	off_t		 st_size;	    // - Size of the directory, used to size the getdents buffer.
 	unsigned long	 st_dev;	    // - File system id for current directory.
 	uid_t		 st_uid;	    // - User ID of the directory's owner
 	gid_t		 st_gid;	    // - Group ID of the directory's group
         ino_t            st_ino;            // - Directory inode number
+	int		 dirfd;		    // - Open directory descriptor, or -1 if it has to be opened by dirpath (option -A)
+	dirbatch_t	*batch;		    // - Set if this is just a batch of entries from a split directory (option -B).
+	chownbatch_t	*chowns;	    // - Entries of this directory to be handed to the chown threads (option --chown-threads).
+	chowndir_t	*chowndir;	    // - Shared by those entries, set once the first one is handed off.
+	boolean		 unchanged;	    // - Set if the directory has not changed since the time given with -s, so just subdirs are handled.
 };
 
 // This is the global list of directories to be processed, malloc'ed later:
@@ -186,350 +524,3455 @@ dirlist_t	*dirlist_head;	    // - first directory in queue
 dirlist_t	*dirlist_tail;	    // - last directory in queue - only for FIFO queue (option -q)
 unsigned	 queuesize = 0;	    // - current number of queued directories waiting to be processed by a thread
 unsigned	 maxdepth = 0;	    // - max directory depth, if option -m is specified
-pthread_mutex_t	 dirlist_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting dirlist_head, dirlist_tail, queuesize
+pthread_mutex_t	 dirlist_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting dirlist_head, dirlist_tail, queuesize, devqueues
+
+// With option --dev-threads, directories are queued per file system instead of in dirlist_head, see devdirlist_extract():
+typedef struct devqueue {
+	unsigned long	 st_dev;	    // - File system id.
+	dirlist_t	*head;		    // - LIFO queue of the directories on this file system.
+	unsigned	 size;		    // - Current number of directories in the queue.
+	unsigned	 busy;		    // - Number of threads processing a directory on this file system right now.
+	unsigned	 busy_max;	    // - Highest number of threads busy at once (option -S).
+	unsigned long long dirs;	    // - Number of directories taken from the queue (option -S).
+} devqueue_t;
+devqueue_t	*devqueues = NULL;
+unsigned	 devqueue_cnt = 0;  // - number of file systems seen so far
+unsigned	 devqueue_size = 0; // - allocated size of devqueues
+
+// Statistics counters. Each thread has its own set in threadlocal_t, so updating them never bounces a cache line
+// between threads, and they are only summed up by stats_sum() when reported (options -S and -v).
+typedef struct stats {
+	unsigned long long entries;	     // - Number of directory entries handled.
+	unsigned long long entries_chowned;  // - Number of files/dirs chown()'ed.
+	unsigned long long entries_unchanged;// - Number of entries not chown()'ed since the ownership was already correct (option -u).
+	unsigned long long ownerstat_calls;  // - Number of statx()/lstat() calls made just to fetch the ownership (options -u, -M, -l).
+	unsigned long long hardlinks_recorded; // - Number of files with more than one link recorded in the hard link set (option -l).
+	unsigned long long hardlinks_skipped;  // - Number of entries skipped, since the file was changed through another link.
+	unsigned long long hardlinks_unrecorded; // - Number of links of such files not recorded, since the set was full.
+	unsigned long long statcount;	     // - Number of lstat calls.
+	unsigned long long statcount_unexp;  // - Number of lstat calls made since d_type was DT_UNKNOWN.
+	unsigned long long statcount_elided; // - Number of lstat calls saved on DT_UNKNOWN entries, since all subdirs were found already.
+	unsigned long long inlined_dirs;     // - Number of subdirectories processed in-line.
+	unsigned long long inlined_plenty;   // - Of those, the ones beyond option -I, since the queue held plenty of work already.
+	unsigned long long inlined_forced;   // - Of those, the ones beyond option -I, since --max-queued was reached.
+	unsigned long long queued_starving;  // - Number of subdirectories queued instead of processed in-line, since threads were idle.
+	unsigned long long queued_dirs;	     // - Number of directories queued to be handled by a separate thread.
+	unsigned long long file_no_access;   // - Number of unsuccessful chown() calls, type EACCES.
+	unsigned long long file_not_found;   // - Number of unsuccessful chown() calls, type ENOENT.
+	unsigned long long file_any_other_error; // - Number of unsuccessful chown() calls, type "any other reason".
+	unsigned long long steals;	     // - Number of directories stolen from other threads' deques (option -W).
+	unsigned long long dirs_split;	     // - Number of directories split into batches (option -B).
+	unsigned long long batches;	     // - Number of batches queued (option -B).
+	unsigned long long dirs_unchanged;   // - Number of unchanged directories just searched for subdirs (option -s).
+	unsigned long long dirs_unread;	     // - Number of unchanged directories without subdirs, not even read (option -s).
+	unsigned long long dirs_excluded;    // - Number of directories skipped by an exclusion rule (options -e, -E, -Z, --exclude-from).
+	unsigned long long getdents_calls;   // - Number of getdents system calls.
+	unsigned long long parks;	     // - Number of times a thread found no work and was parked.
+	unsigned long long timed_calls;	     // - Number of lstat/chown/getdents calls timed for -t auto.
+	unsigned long long timed_nsec;	     // - Total time spent in those calls, in nanoseconds.
+	unsigned long long rate_wait_nsec;   // - Time spent waiting for the ops budget (option -b), in nanoseconds.
+	unsigned long long inode_sorted;     // - Number of entries handled in inode order (option -O).
+	unsigned long long inode_sorts;	     // - Number of chunks of entries sorted on inode number (option -O).
+	unsigned long long chown_handoffs;   // - Number of batches handed to the chown threads (option --chown-threads).
+	unsigned long long chown_ring_full;  // - Number of times a thread had to wait for room in its ring of batches.
+	unsigned long long chown_occupancy;  // - Sum of the number of batches waiting in all rings, at each hand-off.
+	unsigned long long chown_entries;    // - Number of entries chown()'ed by a chown thread.
+	unsigned long long uring_stats;	     // - Number of statx requests made through io_uring (option --io-uring).
+	unsigned long long uring_opens;	     // - Number of openat requests made through io_uring.
+	unsigned long long uring_opens_unused; // - Of those, the directories opened but then queued rather than processed in-line.
+	unsigned long long uring_waits;	     // - Number of times a thread had to wait for a request to complete.
+} stats_t;
+
+typedef struct threadlocal threadlocal_t;
+
+// Data owned by one thread. Worker threads have index 0 .. thread_cnt-1, the main thread has index thread_cnt.
+struct threadlocal {
+	unsigned	 idx;		    // - Index of this thread in threadlocal_arr.
+	pthread_mutex_t	 wsq_lock;	    // - For protecting wsq_head, wsq_tail, wsq_size (option -W).
+	dirlist_t	*wsq_head;	    // - Newest directory in this thread's deque, pushed and popped by the owner.
+	dirlist_t	*wsq_tail;	    // - Oldest directory in this thread's deque, stolen by idle threads.
+	unsigned	 wsq_size;	    // - Current number of directories in this thread's deque.
+	stats_t		 stats;		    // - This thread's statistics counters.
+	dirlist_t	*curnode;	    // - The queued directory (or batch) being processed, saved as unfinished by a checkpoint.
+	checkpoint_buf_t stopbuf;	    // - Directories left unfinished by this thread when stopping, for the final checkpoint.
+	void		*slab_free[SLAB_CLASSES]; // - Free lists of dirlist_t and pathnode_t nodes, per size class.
+	char		*slab_cur;	    // - Unused part of the current slab.
+	size_t		 slab_left;	    // - Number of bytes left at slab_cur.
+	unsigned long	 slab_bytes;	    // - Total size of all slabs allocated by this thread.
+	char		*pathbuf;	    // - The path of the directory being processed, followed by the current entry.
+	size_t		 pathbuf_size;	    // - Allocated size of pathbuf.
+	unsigned long long idle_usec[IDLE_BUCKETS]; // - Time this thread has been parked, per part of the run, see idle_add().
+	unsigned	 idle_shift;	    // - Each bucket of idle_usec covers IDLE_BUCKET_USEC << idle_shift microseconds.
+	unsigned	 rate_credit;	    // - Ops left of those taken from the budget of option -b, see rate_take().
+	unsigned	 devq;		    // - Index+1 in devqueues of the file system of curnode, 0 if none (option --dev-threads).
+	unsigned	 inline_level;	    // - Number of levels of in-line processing the thread is at right now.
+	entbuf_t	*entbuf;	    // - Sort buffers, one per level of in-line processing (option -O).
+	unsigned	 ent_levels;	    // - Number of entries in entbuf.
+	unsigned	 ent_level;	    // - Number of levels currently in use.
+	chownbatch_t	**chown_ring;	    // - CHOWN_RING_SIZE batches handed to the chown threads (option --chown-threads).
+	volatile unsigned long chown_head; // - Number of batches put in the ring, only updated by the owner of the ring.
+	volatile unsigned long chown_tail; // - Number of batches taken from the ring, updated by the chown threads.
+	unsigned long long *map_hits;	    // - Entries each mapping applied to, those of uid_map followed by gid_map (option -M).
+#if defined(HAVE_IO_URING)
+	uring_t		 uring;		    // - Set up the first time it is needed (option --io-uring).
+#endif
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+	dentsbuf_t	*dentsbuf;	    // - getdents buffers, one per level of in-line processing (option -X).
+	unsigned	 dents_levels;	    // - Number of entries in dentsbuf.
+	unsigned	 dents_level;	    // - Number of levels currently in use.
+#endif
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+static threadlocal_t	*threadlocal_arr;   // - thread_cnt+1+chown_threads entries, aligned to CACHELINE_SIZE
+static void		*threadlocal_mem;   // - what was actually malloc'ed for threadlocal_arr
+static pthread_key_t	 threadlocal_key;   // - gives each thread its own entry in threadlocal_arr
+static unsigned		 wsq_next_victim;   // - round-robin deque used when the main thread enqueues start points
 
 static pthread_t	*thread_arr	 	= NULL;
 static unsigned		 thread_cnt	 	= 0; // - set by main(), used by traverse_trees(), thread_prepare(), thread_cleanup()
-static unsigned		 sleeping_thread_cnt	= 0;
+
+static boolean		 auto_threads	= FALSE; // - set by -t auto: tune the number of active threads while running
+static unsigned		 active_threads	= 0; // - threads with a higher index are throttled, see thread_throttle()
+static unsigned short	*tune_log	= NULL; // - active_threads after each AUTO_TUNE_USEC, for -S
+static unsigned		 tune_log_count	= 0;
+static unsigned long long next_tune_usec = 0; // - when thread_tune() is due, in microseconds since run_t0
+
+static char		*rate_file	= NULL; // - option -b, if given as a file with the ops/s budget, read again on SIGHUP
+static unsigned		 rate_ops	= 0; // - ops/s budget of option -b, 0 for no limit
+static unsigned long long rate_interval_nsec = 0; // - time per op, 0 for no limit
+static unsigned		 rate_chunk	= 1; // - number of ops taken from the budget in one go, about 1 ms worth
+static unsigned long long rate_tat	= 0; // - see rate_take()
 #if ! defined(PR_ATOMIC_ADD)
-	static pthread_mutex_t   sleeping_thread_cnt_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting "sleeping_thread_cnt"
+	static pthread_mutex_t	 rate_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting "rate_tat"
+#endif
+static boolean		 background	= FALSE; // - option -b: lower the I/O and CPU priority
+static boolean		 idle_io	= FALSE; // - option --idle-io: use the idle I/O class with -b
+static volatile sig_atomic_t rate_reload = 0; // - set by SIGHUP, rate_file is read again by the main thread
+
+static struct timespec	 run_t0;	    // - when the threads were started, for the idle histograms
+static unsigned long long run_end_usec;	    // - when the last directory was done, in microseconds since run_t0
+
+// - Idle threads park on an eventcount: work_seq is bumped when something is queued while a thread is parked,
+// so that queueing a directory costs no system call while all the threads are busy.
+static unsigned		 outstanding_dirs	= 0; // - directories queued or being processed, the show is over when this drops to zero
+static unsigned		 outstanding_peak	= 0; // - highest outstanding_dirs seen, for -S (not exact, updated without locking)
+static unsigned		 parked_thread_cnt	= 0; // - threads waiting for work in dirlist_pull_dir()
+static int		 work_seq		= 0; // - the futex word on Linux
+#if ! defined(USE_FUTEX)
+	static pthread_mutex_t	 park_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting "work_seq" (and the counters above without PR_ATOMIC_ADD)
+	static pthread_cond_t	 park_cond = PTHREAD_COND_INITIALIZER;
 #endif
 
 #if ! defined(__APPLE__)
 	static sem_t	 master_sem;
-	static sem_t	 threads_sem;
 	static sem_t	 finished_threads_sem;
 #else
 	static dispatch_semaphore_t
 			 master_sem;
-	static dispatch_semaphore_t
-			 threads_sem;
 	static dispatch_semaphore_t
 			 finished_threads_sem;
 #endif
-static unsigned		 sem_val_max_exceeded_cnt = 0;	// - _POSIX_SEM_VALUE_MAX == 32767, so this variable counts all above this value
-static pthread_mutex_t	 sem_val_max_exceeded_cnt_lock = PTHREAD_MUTEX_INITIALIZER; // - for protecting "sem_val_max_exceeded_cnt"
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline __attribute__((always_inline)) void do_chown(
-	const char *path,
-	const uid_t new_owner,
-	const gid_t new_group)
+// Sum up the statistics counters of all threads, including the main thread.
+// The threads may still be running, so this is just a snapshot.
+static void stats_sum(
+	stats_t *sum)
 {
-	int rc;
+	unsigned long long *s = (unsigned long long *)sum;
+	const unsigned long long *t;
+	unsigned i, j;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i <= thread_cnt + chown_threads; i++) {
+		t = (const unsigned long long *)&threadlocal_arr[i].stats;
+		for (j = 0; j < sizeof(stats_t) / sizeof(*s); j++)
+			s[j] += t[j];
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Microseconds since run_t0.
+static inline __attribute__((always_inline)) unsigned long long run_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - run_t0.tv_sec) * 1000000ULL + ts.tv_nsec / 1000 - run_t0.tv_nsec / 1000;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) unsigned long long mono_nsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Option -b: take one op from the budget shared by all threads, waiting for it if needed.
+// The budget is a token bucket kept as a "theoretical arrival time" (rate_tat): each op moves it rate_interval_nsec
+// ahead, and an op may not start before its slot. A thread reserves rate_chunk ops at a time with a single atomic add,
+// and then uses them up on its own. Unused time is saved up for at most RATE_BURST_NSEC.
+static void rate_take(
+	threadlocal_t *tl)
+{
+	unsigned long long now, tat, need;
+
+	if (tl->rate_credit) {
+		tl->rate_credit--;
+		return;
+	}
+	need = rate_chunk * rate_interval_nsec;
+	now = mono_nsec();
+#     if defined(PR_ATOMIC_ADD)
+	tat = rate_tat;
+	if (tat + RATE_BURST_NSEC < now)
+		(void) __sync_bool_compare_and_swap(&rate_tat, tat, now - RATE_BURST_NSEC); // - if it fails, someone else did it
+	tat = PR_ATOMIC_ADD(&rate_tat, need) - need; // - the start of our slot
+#     else
+	pthread_mutex_lock(&rate_lock);
+	if (rate_tat + RATE_BURST_NSEC < now)
+		rate_tat = now - RATE_BURST_NSEC;
+	tat = rate_tat;
+	rate_tat += need;
+	pthread_mutex_unlock(&rate_lock);
+#     endif
+	tl->rate_credit = rate_chunk - 1;
+
+	if (tat > now) {
+		struct timespec ts;
+		ts.tv_sec = (tat - now) / 1000000000;
+		ts.tv_nsec = (tat - now) % 1000000000;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+		tl->stats.rate_wait_nsec += tat - now;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Called before each lstat/chown/getdents call, which is where the ops budget of option -b is taken.
+// With -t auto, the call is timed for thread_tune(), and the start time is returned. Returns 0 otherwise.
+static inline __attribute__((always_inline)) unsigned long long metaop_start(
+	threadlocal_t *tl)
+{
+	if (rate_interval_nsec)
+		rate_take(tl);
+	if (! auto_threads)
+		return 0;
+	return mono_nsec();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) void metaop_end(
+	threadlocal_t *tl,
+	unsigned long long start)
+{
+	if (! start)
+		return;
+	tl->stats.timed_calls++;
+	tl->stats.timed_nsec += mono_nsec() - start;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Add the time from start to end (in microseconds since run_t0) when the thread was parked to its idle histogram.
+// When the run outgrows the histogram, neighbouring buckets are merged, and the bucket width is doubled.
+static void idle_add(
+	threadlocal_t *tl,
+	unsigned long long start,
+	unsigned long long end)
+{
+	unsigned long long width, bucket_end;
+	unsigned i;
+
+	while ((end >> tl->idle_shift) / IDLE_BUCKET_USEC >= IDLE_BUCKETS) {
+		for (i = 0; i < IDLE_BUCKETS / 2; i++)
+			tl->idle_usec[i] = tl->idle_usec[2 * i] + tl->idle_usec[2 * i + 1];
+		memset(tl->idle_usec + IDLE_BUCKETS / 2, 0, IDLE_BUCKETS / 2 * sizeof(*tl->idle_usec));
+		tl->idle_shift++;
+	}
+
+	width = (unsigned long long)IDLE_BUCKET_USEC << tl->idle_shift;
+	while (start < end) {
+		i = start / width;
+		bucket_end = (i + 1) * width;
+		if (bucket_end > end)
+			bucket_end = end;
+		tl->idle_usec[i] += bucket_end - start;
+		start = bucket_end;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Sum up the worker threads' idle time from tail_start until the end of the run (option -S).
+// The idle time is assumed to be evenly spread within a bucket.
+static double idle_sum(
+	unsigned long long tail_start)
+{
+	unsigned long long width, from, to;
+	double sum = 0;
+	unsigned i, b;
+
+	for (i = 0; i < thread_cnt; i++) {
+		width = (unsigned long long)IDLE_BUCKET_USEC << threadlocal_arr[i].idle_shift;
+		for (b = tail_start / width; b < IDLE_BUCKETS; b++) {
+			from = b * width > tail_start ? b * width : tail_start;
+			to = (b + 1) * width < run_end_usec ? (b + 1) * width : run_end_usec;
+			if (to > from)
+				sum += (double)threadlocal_arr[i].idle_usec[b] * (to - from) / width;
+		}
+	}
+	return sum;
+}
+
+/////////////////////////////////////////////////////////////////////////////
 
-        rc = lchown(path, new_owner, new_group);
+static inline __attribute__((always_inline)) void count_chown(
+	threadlocal_t *tl,
+	int rc)
+{
         if (rc < 0) {
                 switch (errno) {
                 	case EACCES:
-                        	file_no_access++;
+                        	tl->stats.file_no_access++;
                                 break;
                         case ENOENT:
-                                file_not_found++;
+                                tl->stats.file_not_found++;
                                 break;
                         default:
-                                file_any_other_error++;
+                                tl->stats.file_any_other_error++;
                 }
 		pthread_mutex_lock(&perror_lock);
                 perror("chown()");
 		pthread_mutex_unlock(&perror_lock);
+	} else
+		tl->stats.entries_chowned++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) void do_chown(
+	threadlocal_t *tl,
+	const char *path,
+	const uid_t new_owner,
+	const gid_t new_group)
+{
+	unsigned long long t0 = metaop_start(tl);
+	int rc = lchown(path, new_owner, new_group);
+
+	metaop_end(tl, t0);
+	count_chown(tl, rc);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+#if defined(AT_SYMLINK_NOFOLLOW)
+// Used by option -A; name is relative to the open directory dirfd, or NULL to chown the directory itself.
+static inline __attribute__((always_inline)) void do_chownat(
+	threadlocal_t *tl,
+	int dirfd,
+	const char *name,
+	const uid_t new_owner,
+	const gid_t new_group)
+{
+	unsigned long long t0 = metaop_start(tl);
+	int rc;
+
+	if (name)
+		rc = fchownat(dirfd, name, new_owner, new_group, AT_SYMLINK_NOFOLLOW);
+	else
+		rc = fchown(dirfd, new_owner, new_group);
+	metaop_end(tl, t0);
+	count_chown(tl, rc);
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) unsigned idmap_hash(
+	unsigned long id)
+{
+	id ^= id >> 16;
+	id *= 0x45d9f3b;
+	id ^= id >> 16;
+	return (unsigned)id;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Look up id in the ownership map (option -M), and return TRUE with the new id in *new_id if a mapping applies.
+// The hit is counted for the mapping in the thread's hits, one counter per mapping of map, if hits is set.
+static inline __attribute__((always_inline)) boolean idmap_lookup(
+	idmap_t *map,
+	unsigned long id,
+	unsigned long *new_id,
+	unsigned long long *hits)
+{
+	idmap_range_t *r = NULL;
+	unsigned i, lo, hi;
+
+	if (map->hash)
+		for (i = idmap_hash(id) & map->hash_mask; map->hash[i]; i = (i + 1) & map->hash_mask)
+			if (map->ranges[map->hash[i] - 1].first == id) {
+				r = &map->ranges[map->hash[i] - 1];
+				break;
+			}
+
+	if (! r && map->interval_count) {
+		// - Find the last range starting at or below id.
+		for (lo = 0, hi = map->interval_count; hi - lo > 1; ) {
+			i = (lo + hi) / 2;
+			if (map->ranges[map->intervals[i]].first <= id)
+				lo = i;
+			else
+				hi = i;
+		}
+		r = &map->ranges[map->intervals[lo]];
+		if (id < r->first || id > r->last)
+			r = NULL;
+	}
+
+	if (! r)
+		return FALSE;
+	if (hits)
+		hits[r - map->ranges]++;
+	*new_id = r->new_first + (id - r->first);
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Work out the new user/group of an entry owned by uid/gid, in *nuid/*ngid, -1 for what should be left alone.
+// That is new_uid/new_gid, or what the ownership map (option -M) says, where hits are counted for thread tl if set.
+// Returns TRUE if chown()'ing the entry would change anything.
+static inline __attribute__((always_inline)) boolean new_owner(
+	const uid_t uid,
+	const gid_t gid,
+	uid_t *nuid,
+	gid_t *ngid,
+	threadlocal_t *tl)
+{
+	if (map_file) {
+		unsigned long id;
+		*nuid = uid != (uid_t)-1 && idmap_lookup(&uid_map, uid, &id, tl ? tl->map_hits : NULL) ? (uid_t)id : (uid_t)-1;
+		*ngid = gid != (gid_t)-1 && idmap_lookup(&gid_map, gid, &id, tl ? tl->map_hits + uid_map.count : NULL) ? (gid_t)id : (gid_t)-1;
 	} else {
-#             if defined(PR_ATOMIC_ADD)
-                PR_ATOMIC_ADD(&entries_chowned, 1);
-#             else
-                pthread_mutex_lock(&entries_chowned_lock);
-		entries_chowned++;
-                pthread_mutex_unlock(&entries_chowned_lock);
-#             endif
+		*nuid = new_uid;
+		*ngid = new_gid;
 	}
+	return (*nuid != (uid_t)-1 && *nuid != uid) || (*ngid != (gid_t)-1 && *ngid != gid);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-#include "commonlib.h"
+// Returns TRUE if chown()'ing an entry owned by uid/gid to its new user/group would change anything.
+static inline __attribute__((always_inline)) boolean owner_differs(
+	const uid_t uid,
+	const gid_t gid)
+{
+	uid_t nuid;
+	gid_t ngid;
+
+	return new_owner(uid, gid, &nuid, &ngid, NULL);
+}
 
 /////////////////////////////////////////////////////////////////////////////
 
-// Used by walk_dir:
-static inline void handle_dirent(dirlist_t *, struct dirent *);
+// Returns TRUE if a directory has not changed since the time given with -s.
+// Adding, removing or renaming an entry updates the mtime of the directory, and chown() updates its ctime,
+// so neither the set of entries nor the ownership of the directory itself can have changed.
+static inline __attribute__((always_inline)) boolean unchanged_since(
+	const struct stat *st)
+{
+	return since && st->st_mtime < since && st->st_ctime < since;
+}
 
 /////////////////////////////////////////////////////////////////////////////
 
-static void walk_dir(
-	dirlist_t *curdir)
+static inline __attribute__((always_inline)) void checkpoint_reserve(
+	checkpoint_buf_t *cb,
+	size_t len)
 {
-	DIR *dir = NULL;
-#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-	unsigned fd = 0;    		// - only used on Linux/*BSD if option -X is given
-	char *buf = NULL;   		// - same
-	unsigned bpos = 0, nread = 0;	// - same
-#endif
-	struct dirent *dent = NULL;
+	if (cb->len + len > cb->size) {
+		if (! cb->size)
+			cb->size = 64*1024;
+		while (cb->len + len > cb->size)
+			cb->size *= 2;
+		cb->buf = realloc(cb->buf, cb->size);
+		assert(cb->buf);
+	}
+}
 
-#     if defined(DEBUG2)
-	if (getenv("DEBUG2") && curdir->depth <= 2)
-		fprintf(stderr, "- opendir(%s)\n", curdir->dirpath);
-#     endif
-	//assert(curdir->dirpath);
+/////////////////////////////////////////////////////////////////////////////
 
-#    if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-	if (extreme_readdir) {
-		if ((fd = open(curdir->dirpath, O_RDONLY | O_DIRECTORY)) < 0) {
-			pthread_mutex_lock(&perror_lock);
-			perror(curdir->dirpath);
-			pthread_mutex_unlock(&perror_lock);
-			return;
+static inline __attribute__((always_inline)) void checkpoint_add(
+	checkpoint_buf_t *cb,
+	char type,
+	unsigned depth,
+	off_t pos,
+	const char *path,
+	size_t len)
+{
+	checkpoint_reserve(cb, len + 48); // - room for type, depth, position, separators and nul
+	cb->len += sprintf(cb->buf + cb->len, "%c%u:%lld:%s", type, depth, (long long)pos, path) + 1;
+	cb->dirs++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Save the entries from entry up to end of a batch (option -B).
+static void checkpoint_add_batch(
+	checkpoint_buf_t *cb,
+	unsigned depth,
+	const char *path,
+	size_t len,
+	const char *entry,
+	const char *end)
+{
+	unsigned cnt = 0;
+	char *e;
+
+	if (entry >= end)
+		return;
+	for (e = (char *)entry; e < end; e += strlen(e + 1) + 2)
+		cnt++;
+	checkpoint_reserve(cb, len + 48 + (end - entry));
+	cb->len += sprintf(cb->buf + cb->len, "B%u:%u:%s", depth, cnt, path) + 1;
+	memcpy(cb->buf + cb->len, entry, end - entry);
+	for (e = cb->buf + cb->len; e < cb->buf + cb->len + (end - entry); e += strlen(e + 1) + 2)
+		*e += 'A'; // - d_type may be 0
+	cb->len += end - entry;
+	cb->dirs++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Write the whole path of a directory, given its parent and its own name, to buf, which has room for len + 1 bytes.
+// The path is built backwards, from the name through each parent up to the start point.
+static inline __attribute__((always_inline)) void path_build(
+	char *buf,
+	const pathnode_t *parent,
+	const char *name,
+	unsigned name_len,
+	unsigned len)
+{
+	char *p = buf + len;
+
+	*p = '\0';
+	p -= name_len;
+	memcpy(p, name, name_len);
+	for (; parent; parent = parent->parent) {
+		if (p - buf > parent->len) // - no / after a parent which is / itself
+			*--p = '/';
+		p -= parent->name_len;
+		memcpy(p, parent->name, parent->name_len);
+	}
+	assert(p == buf);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// A batch (option -B) is just a part of a directory - if it is being processed, the whole directory is processed again.
+// Only called by the main thread, so the path can be built in a buffer of its own.
+static inline __attribute__((always_inline)) void checkpoint_add_node(
+	checkpoint_buf_t *cb,
+	char type,
+	dirlist_t *node)
+{
+	static char *path = NULL;
+	static size_t size = 0;
+
+	if (node->dirpath_len + 1 > size) {
+		path = realloc(path, size = node->dirpath_len + 1 + 256);
+		assert(path);
+	}
+	path_build(path, node->parent, node->name, node->name_len, node->dirpath_len);
+
+	if (! node->batch)
+		checkpoint_add(cb, type, node->depth, 0, path, node->dirpath_len);
+	else if (type == 'P')
+		checkpoint_add(cb, 'P', node->depth, 0, path, node->dirpath_len);
+	else
+		checkpoint_add_batch(cb, node->depth, path, node->dirpath_len,
+			node->batch->entries, node->batch->entries + node->batch->len);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Save the entries handed to the chown threads and not done yet (option --chown-threads), like those of a batch of a split
+// directory, so a resumed run handles just these entries again, rather than their directories all over again.
+static void checkpoint_add_chowns(
+	checkpoint_buf_t *cb)
+{
+	chownbatch_t *batch;
+	char *entry, *name;
+	size_t name_len;
+
+	pthread_mutex_lock(&chownbatch_lock);
+	for (batch = chownbatch_live; batch; batch = batch->next) {
+		checkpoint_reserve(cb, batch->dir->dirpath_len + 48 + batch->len);
+		cb->len += sprintf(cb->buf + cb->len, "B%u:%u:%s", batch->dir->depth, batch->cnt, batch->dir->dirpath) + 1;
+		for (entry = batch->entries; entry < batch->entries + batch->len; entry = name + name_len + 1) {
+			name = entry + sizeof(uid_t) + sizeof(gid_t) + 1;
+			name_len = strlen(name);
+			cb->buf[cb->len++] = name[-1] + 'A'; // - d_type may be 0
+			memcpy(cb->buf + cb->len, name, name_len + 1);
+			cb->len += name_len + 1;
+		}
+		cb->dirs++;
+	}
+	pthread_mutex_unlock(&chownbatch_lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Save all directories left to process to checkpoint_file, and return how many they are, or -1 if it failed.
+// The queue(s) are locked the same way as by the threads pulling a directory, see dirlist_done(),
+// so this may be done while the threads are running.
+static int checkpoint_write()
+{
+	checkpoint_buf_t cb;
+	dirlist_t *node, **stack = NULL;
+	unsigned i, sp = 0, stacksize = 0;
+	size_t done;
+	ssize_t rc = 0;
+	int fd;
+
+	cb.buf = NULL;
+	cb.len = cb.size = 0;
+	checkpoint_reserve(&cb, sizeof(CHECKPOINT_MAGIC) + 72);
+	cb.len = sprintf(cb.buf, "%s%c%lu:%lu:%ld", CHECKPOINT_MAGIC, '\0', (unsigned long)new_uid, (unsigned long)new_gid, (long)run_start);
+	if (map_file)
+		cb.len += sprintf(cb.buf + cb.len, ":%llx", map_hash);
+	cb.len++;
+	cb.dirs = 0;
+
+	if (ws_queue) {
+		for (i = 0; i < thread_cnt; i++)
+			pthread_mutex_lock(&threadlocal_arr[i].wsq_lock);
+		for (i = 0; i < thread_cnt; i++)
+			for (node = threadlocal_arr[i].wsq_head; node; node = node->next)
+				checkpoint_add_node(&cb, 'Q', node);
+	} else {
+		pthread_mutex_lock(&dirlist_lock);
+		if (heap_queue) {
+			// - The pairing heap is walked using a stack of its own, children (prev) and siblings (next) alike.
+			if (queuesize && dirlist_head) {
+				stack = malloc((stacksize = 1024) * sizeof(*stack));
+				assert(stack);
+				stack[sp++] = dirlist_head;
+			}
+			while (sp) {
+				node = stack[--sp];
+				checkpoint_add_node(&cb, 'Q', node);
+				if (sp + 2 > stacksize) {
+					stack = realloc(stack, (stacksize *= 2) * sizeof(*stack));
+					assert(stack);
+				}
+				if (node->prev)
+					stack[sp++] = node->prev;
+				if (node->next)
+					stack[sp++] = node->next;
+			}
+			free(stack);
+		} else if (dev_threads) {
+			for (i = 0; i < devqueue_cnt; i++)
+				for (node = devqueues[i].head; node; node = node->next)
+					checkpoint_add_node(&cb, 'Q', node);
+		} else {
+			for (node = dirlist_head; node; node = node->next)
+				checkpoint_add_node(&cb, 'Q', node);
 		}
-		dent = malloc(sizeof(struct dirent));
-		assert(dent);
-		buf = malloc(buf_size);
-		assert(buf);
+	}
+
+	// - While running, the directories being processed have to be processed all over again.
+	// When stopping, the threads have instead saved exactly where they left each directory.
+	for (i = 0; i < thread_cnt; i++) {
+		if ((node = threadlocal_arr[i].curnode))
+			checkpoint_add_node(&cb, 'P', node);
+		if (threadlocal_arr[i].stopbuf.len) {
+			checkpoint_reserve(&cb, threadlocal_arr[i].stopbuf.len);
+			memcpy(cb.buf + cb.len, threadlocal_arr[i].stopbuf.buf, threadlocal_arr[i].stopbuf.len);
+			cb.len += threadlocal_arr[i].stopbuf.len;
+			cb.dirs += threadlocal_arr[i].stopbuf.dirs;
+		}
+	}
+
+	// - A directory done by its thread may still have entries waiting for the chown threads (option --chown-threads).
+	//   When stopping, the chown threads have finished them all.
+	if (chown_threads)
+		checkpoint_add_chowns(&cb);
+
+	if (ws_queue) {
+		for (i = 0; i < thread_cnt; i++)
+			pthread_mutex_unlock(&threadlocal_arr[i].wsq_lock);
 	} else
-#    endif
-	if (! (dir = opendir(curdir->dirpath))) {
-			pthread_mutex_lock(&perror_lock);
-			perror(curdir->dirpath);
-			pthread_mutex_unlock(&perror_lock);
-			return;
+		pthread_mutex_unlock(&dirlist_lock);
+
+	// - Write to a temporary file first, so there is always a complete checkpoint in place.
+	if ((fd = open(checkpoint_tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+		fprintf(stderr, "%s: ", progname);
+		perror(checkpoint_tmpfile);
+		free(cb.buf);
+		return -1;
 	}
+	for (done = 0; done < cb.len; done += rc) {
+		if ((rc = write(fd, cb.buf + done, cb.len - done)) < 0)
+			break;
+	}
+	free(cb.buf);
+	if (rc < 0 || fsync(fd) < 0 || close(fd) < 0 || rename(checkpoint_tmpfile, checkpoint_file) < 0) {
+		fprintf(stderr, "%s: ", progname);
+		perror(checkpoint_file);
+		return -1;
+	}
+
+	checkpoints_written++;
+	if (debug)
+		fprintf(stderr, "Checkpoint written to %s: %u directories\n", checkpoint_file, cb.dirs);
+	return cb.dirs;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Print the progress when another verbose_count entries have been handled (option -v), at most once a second.
+static void progress_report()
+{
+	time_t t = time(NULL);
+	stats_t sum;
+
+	if (! last_t)
+		last_t = t;
+	if (t == last_t)
+		return;
+	stats_sum(&sum);
+	if (sum.entries >= last_entries + verbose_count) {
+		fprintf(stderr, "About %llu files processed (%llu files/s)...\n", sum.entries, (sum.entries - last_entries) / (t - last_t));
+		last_entries = sum.entries;
+		last_t = t;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Change the number of active threads (option -t auto), and wake up the throttled threads if it went up.
+static void active_threads_set(
+	unsigned n)
+{
+#     if defined(USE_FUTEX)
+	unsigned old = active_threads;
+
+	active_threads = n;
+	if (n > old)
+		syscall(SYS_futex, &active_threads, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#     else
+	pthread_mutex_lock(&park_lock);
+	active_threads = n;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+#     endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Set the ops/s budget of option -b, 0 for no limit.
+static void rate_set(
+	unsigned ops)
+{
+	rate_ops = ops;
+	rate_chunk = ops / 1000; // - about 1 ms worth
+	if (rate_chunk < 1)
+		rate_chunk = 1;
+	if (rate_chunk > RATE_CHUNK_MAX)
+		rate_chunk = RATE_CHUNK_MAX;
+	rate_interval_nsec = ops ? 1000000000ULL / ops : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Read the ops/s budget from the file given with -b. Returns FALSE if it could not be read.
+static boolean rate_read()
+{
+	unsigned ops;
+	FILE *fp;
+	int n;
+
+	if (! (fp = fopen(rate_file, "r"))) {
+		fprintf(stderr, "%s: ", progname);
+		perror(rate_file);
+		return FALSE;
+	}
+	n = fscanf(fp, "%u", &ops);
+	fclose(fp);
+	if (n != 1) {
+		fprintf(stderr, "%s: No ops/s budget found in %s\n", progname, rate_file);
+		return FALSE;
+	}
+	rate_set(ops);
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Used by option -t auto: the main thread calls this every AUTO_TUNE_USEC to hill-climb the number of active threads.
+// As long as adding (or removing) threads raises the number of entries handled per second by more than 5%,
+// it goes on in the same direction, with bigger and bigger steps. When it gets worse, it turns around with a smaller step.
+// When nothing changes much, it backs off if the lstat/chown/getdents calls have become more than twice as slow as the
+// fastest seen lately, since more threads then just queue up in the file server.
+// No more threads are added while some of the active ones are idle for lack of work.
+static void thread_tune()
+{
+	static unsigned long long last_usec, last_entries, last_calls, last_nsec;
+	static double last_rate, lat_min;
+	static int dir = 1;
+	static unsigned step = 1;
+	unsigned long long usec = run_usec();
+	stats_t sum;
+	double rate, lat;
+	int n = active_threads;
+
+	stats_sum(&sum);
+	if (sum.timed_calls - last_calls < 16) { // - too little to go by, e.g. stuck waiting for the file server
+		next_tune_usec = usec + AUTO_TUNE_USEC;
+		return;
+	}
+	rate = (double)(sum.entries - last_entries) * 1000000 / (usec - last_usec);
+	lat = (double)(sum.timed_nsec - last_nsec) / (sum.timed_calls - last_calls);
+	if (! lat_min || lat < lat_min)
+		lat_min = lat;
+	else
+		lat_min *= 1.01; // - let it creep up, so a file server that gets slower for everybody is accepted after a while
+
+	if (last_rate) {
+		if (rate > last_rate * 1.05) {
+			if (step < AUTO_MAX_STEP)
+				step *= 2;
+		} else if (rate < last_rate * 0.95) {
+			dir = -dir;
+			if (step > 1)
+				step /= 2;
+		} else if (lat > lat_min * 2)
+			dir = -1;
+	}
+	if (dir < 0 || ! parked_thread_cnt)
+		n += dir * (int)step;
+	if (n < 1)
+		n = 1;
+	if (n > (int)thread_cnt)
+		n = thread_cnt;
+	if (debug && n != (int)active_threads)
+		fprintf(stderr, "thread_tune(): %.0f entries/s, %.1f us/call - %u -> %d active threads\n", rate, lat / 1000, active_threads, n);
+	if (n != (int)active_threads)
+		active_threads_set(n);
+
+	if (! (tune_log_count & (tune_log_count + 1))) { // - at 0, 1, 3, 7 ...
+		tune_log = realloc(tune_log, 2 * (tune_log_count + 1) * sizeof(*tune_log));
+		assert(tune_log);
+	}
+	tune_log[tune_log_count++] = n;
+
+	last_usec = usec;
+	last_entries = sum.entries;
+	last_calls = sum.timed_calls;
+	last_nsec = sum.timed_nsec;
+	last_rate = rate;
+	next_tune_usec = usec + AUTO_TUNE_USEC;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Used by traverse_trees() when waiting for the threads.
+// With option -b <file>, SIGHUP makes it read the ops budget again.
+// With option -t auto, wake up every AUTO_TUNE_USEC to tune the number of active threads.
+// With option -C, wake up in time to write a checkpoint every checkpoint_interval seconds, and to stop at the deadline (option -D).
+// With option -v, wake up every second to report the progress.
+static void master_wait()
+{
+	struct timespec ts;
+	time_t now, wakeup = 0;
+
+	if (rate_reload) { // - SIGHUP (option -b)
+		rate_reload = 0;
+		if (rate_read())
+			fprintf(stderr, "%s: Ops budget is now %u ops/s%s\n", progname, rate_ops, rate_ops ? "" : " (no limit)");
+	}
+
+	if (checkpoint_file && checkpoint_interval) {
+		if (! next_checkpoint)
+			next_checkpoint = time(NULL) + checkpoint_interval;
+		wakeup = next_checkpoint;
+	}
+	if (deadline && (! wakeup || deadline < wakeup))
+		wakeup = deadline;
+	if (verbose_count) {
+		progress_report();
+		now = time(NULL);
+		if (! wakeup || now + 1 < wakeup)
+			wakeup = now + 1;
+	}
+
+	if (! wakeup && ! auto_threads) {
+#	      if ! defined(__APPLE__)
+		sem_wait(&master_sem);
+#	      else
+		dispatch_semaphore_wait(master_sem, DISPATCH_TIME_FOREVER);
+#	      endif
+		return;
+	}
+
+	ts.tv_sec = wakeup;
+	ts.tv_nsec = 0;
+	if (auto_threads) {
+		unsigned long long usec = run_usec();
+		struct timespec tune;
+		clock_gettime(CLOCK_REALTIME, &tune);
+		if (! next_tune_usec)
+			next_tune_usec = usec + AUTO_TUNE_USEC;
+		if (next_tune_usec > usec) {
+			tune.tv_sec += (next_tune_usec - usec) / 1000000;
+			tune.tv_nsec += (next_tune_usec - usec) % 1000000 * 1000;
+			if (tune.tv_nsec >= 1000000000) {
+				tune.tv_sec++;
+				tune.tv_nsec -= 1000000000;
+			}
+		}
+		if (! wakeup || tune.tv_sec < wakeup)
+			ts = tune;
+	}
+#     if ! defined(__APPLE__)
+	if (! sem_timedwait(&master_sem, &ts))
+		return;
+#     else
+	if (! dispatch_semaphore_wait(master_sem, dispatch_walltime(&ts, 0)))
+		return;
+#     endif
+
+	// - Timed out, or interrupted by a signal
+	if (auto_threads && run_usec() >= next_tune_usec)
+		thread_tune();
+	now = time(NULL);
+	if (deadline && now >= deadline)
+		stop_requested = -1;
+	else if (! stop_requested && next_checkpoint && now >= next_checkpoint) {
+		(void) checkpoint_write();
+		next_checkpoint = time(NULL) + checkpoint_interval;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// SIGINT and SIGTERM make the main thread stop the run and write a final checkpoint (option -C).
+static void stop_handler(
+	int sig)
+{
+	stop_requested = sig;
+#     if ! defined(__APPLE__)
+	sem_post(&master_sem);
+#     else
+	dispatch_semaphore_signal(master_sem);
+#     endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// SIGHUP makes the main thread read the ops budget from the file given with -b again.
+static void rate_handler(
+	int sig)
+{
+	(void) sig;
+	rate_reload = 1;
+#     if ! defined(__APPLE__)
+	sem_post(&master_sem);
+#     else
+	dispatch_semaphore_signal(master_sem);
+#     endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Option -b: lower the I/O priority (Linux) and the CPU priority. Done before the threads are created, which inherit it.
+static void background_priority()
+{
+#     if defined(__linux__) && defined(SYS_ioprio_set)
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    idle_io ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0) : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)) < 0) {
+		fprintf(stderr, "%s: ", progname);
+		perror("ioprio_set()");
+	}
+#     endif
+	errno = 0;
+	if (nice(BACKGROUND_NICE) == -1 && errno) {
+		fprintf(stderr, "%s: ", progname);
+		perror("nice()");
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) unsigned str_hash(
+	const char *str)
+{
+	unsigned h = 2166136261u; // - FNV-1a
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+	return h;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Returns index+1 into resume_paths/resume_pos if path is one of the directories queued from the checkpoint (option -R), else 0.
+static inline __attribute__((always_inline)) unsigned resume_lookup(
+	const char *path)
+{
+	unsigned i;
+
+	for (i = str_hash(path) & resume_set_mask; resume_set[i]; i = (i + 1) & resume_set_mask)
+		if (! strcmp(resume_paths[resume_set[i] - 1], path))
+			return resume_set[i];
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Load the checkpoint given with option -R, and return the directories left to process and their depths.
+// The directories are also put in resume_set, so they are skipped when found below a directory that is processed again.
+// Returns FALSE if there is no such file, and the start points on the command line should be used.
+static boolean resume_load(
+	const char *file,
+	char ***dirpaths,
+	unsigned *dircount,
+	unsigned **depths)
+{
+	struct stat st;
+	char *buf, *rec, *end, *path;
+	unsigned long uid, gid;
+	long start;
+	unsigned long long hash = 0;
+	unsigned n, i, depth;
+	off_t pos;
+	ssize_t rc;
+	size_t done;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return FALSE;
+		fprintf(stderr, "%s: ", progname);
+		perror(file);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: ", progname);
+		perror(file);
+		exit(1);
+	}
+	buf = malloc(st.st_size + 1);
+	assert(buf);
+	for (done = 0; done < (size_t)st.st_size; done += rc) {
+		if ((rc = read(fd, buf + done, st.st_size - done)) <= 0) {
+			fprintf(stderr, "%s: ", progname);
+			perror(file);
+			exit(1);
+		}
+	}
+	close(fd);
+	buf[st.st_size] = '\0';
+	end = buf + st.st_size;
+
+	if (strcmp(buf, CHECKPOINT_MAGIC)) {
+		fprintf(stderr, "%s: %s is not a checkpoint file - bailing out.\n", progname, file);
+		exit(1);
+	}
+	rec = buf + strlen(buf) + 1;
+	if (rec >= end || (n = sscanf(rec, "%lu:%lu:%ld:%llx", &uid, &gid, &start, &hash)) < 2) {
+		fprintf(stderr, "%s: %s is not a complete checkpoint file - bailing out.\n", progname, file);
+		exit(1);
+	}
+	if (uid != (unsigned long)new_uid || gid != (unsigned long)new_gid) {
+		fprintf(stderr, "%s: %s was written by a run with another user/group - bailing out.\n", progname, file);
+		exit(1);
+	}
+	if ((n == 4 ? hash : 0) != map_hash) {
+		fprintf(stderr, "%s: %s was written by a run with another ownership map (-M) - bailing out.\n", progname, file);
+		exit(1);
+	}
+	if (n >= 3)
+		run_start = start; // - the stamp file (option -s) gets the time the interrupted run started
+	rec += strlen(rec) + 1;
+
+	for (n = 0, path = rec; path < end; path += strlen(path) + 1)
+		n++;
+	for (i = 16; i < 2 * n; i *= 2)
+		;
+	resume_set = calloc(i, sizeof(*resume_set));
+	resume_set_mask = i - 1;
+	resume_paths = malloc((n + 1) * sizeof(*resume_paths));
+	resume_pos = malloc((n + 1) * sizeof(*resume_pos));
+	*depths = malloc((n + 1) * sizeof(**depths));
+	assert(resume_set && resume_paths && resume_pos && *depths);
+
+	resume_batches = malloc((n + 1) * sizeof(*resume_batches));
+	assert(resume_batches);
+
+	for (; rec < end; rec += strlen(rec) + 1) {
+		depth = strtoul(rec + 1, &path, 10);
+		if ((*rec != 'Q' && *rec != 'P' && *rec != 'B') || *path != ':' || ! depth) {
+			fprintf(stderr, "%s: Bad record in checkpoint file %s - bailing out.\n", progname, file);
+			exit(1);
+		}
+		pos = strtoll(path + 1, &path, 10);
+		if (*path++ != ':') {
+			fprintf(stderr, "%s: Bad record in checkpoint file %s - bailing out.\n", progname, file);
+			exit(1);
+		}
+		if (*rec == 'B') {
+			// - pos is the number of entry records following
+			resume_batch_t *rb = &resume_batches[resume_batch_count++];
+			rb->dirpath = path;
+			rb->depth = depth;
+			rb->entries = rec = path + strlen(path) + 1;
+			while (pos-- > 0 && rec < end)
+				rec += strlen(rec) + 1;
+			rb->len = rec - rb->entries;
+			rec--; // - points at the nul ending the last entry, skipped by the loop
+			continue;
+		}
+		if ((i = resume_lookup(path))) {
+			// - e.g. several batches of the same directory, which has to be processed all over again then
+			if (resume_pos[i - 1] != pos)
+				resume_pos[i - 1] = 0;
+			continue;
+		}
+		for (i = str_hash(path) & resume_set_mask; resume_set[i]; i = (i + 1) & resume_set_mask)
+			;
+		resume_paths[resume_count] = path;
+		resume_pos[resume_count] = pos;
+		(*depths)[resume_count] = depth;
+		resume_set[i] = ++resume_count;
+	}
+	*dirpaths = resume_paths;
+	*dircount = resume_count;
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Tells from the file system type whether directory link counts can be trusted, for the file system of path.
+// File systems not known to be non-compliant are trusted until a directory with a link count below 2 is seen, see walk_dir().
+static boolean devfs_probe(
+	const char *path)
+{
+#     if defined(__linux__)
+	struct statfs stfs;
+
+	if (statfs(path, &stfs) < 0)
+		return TRUE;
+	switch ((unsigned long)stfs.f_type & 0xffffffffUL) {
+		case 0x9123683eUL: // - btrfs
+		case 0x65735546UL: // - fuse
+		case 0x794c7630UL: // - overlay
+		case 0x4d44UL:	   // - fat
+		case 0x2011bab0UL: // - exfat
+		case 0x5346544eUL: // - ntfs
+		case 0x7366746eUL: // - ntfs3
+		case 0xff534d42UL: // - cifs
+		case 0xfe534d42UL: // - smb2
+		case 0x15013346UL: // - udf
+		case 0x9660UL:	   // - iso9660
+			if (debug)
+				fprintf(stderr, "%s: file system type 0x%lx, POSIX compliance = FALSE\n", path, (unsigned long)stfs.f_type);
+			return FALSE;
+	}
+#     elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+	static const char *fstypes[] = { "msdosfs", "exfat", "ntfs", "fusefs", "fuse", "macfuse", "osxfuse", "smbfs", "cd9660", "udf", NULL };
+	struct statfs stfs;
+	unsigned i;
+
+	if (statfs(path, &stfs) < 0)
+		return TRUE;
+	for (i = 0; fstypes[i]; i++)
+		if (strcmp(stfs.f_fstypename, fstypes[i]) == 0) {
+			if (debug)
+				fprintf(stderr, "%s: file system type %s, POSIX compliance = FALSE\n", path, stfs.f_fstypename);
+			return FALSE;
+		}
+#     elif defined(__sun__)
+	struct statvfs stfs;
+
+	if (statvfs(path, &stfs) < 0)
+		return TRUE;
+	// Solaris file system is assumed to be POSIX compliant if fstype != hsfs && fstype != udfs && fstype != proc
+	if (strcmp(stfs.f_basetype, "hsfs") == 0
+		|| strcmp(stfs.f_basetype, "udfs") == 0
+		|| strcmp(stfs.f_basetype, "proc") == 0) {
+		if (debug)
+			fprintf(stderr, "%s: file system type %s, POSIX compliance = FALSE\n", path, stfs.f_basetype);
+		return FALSE;
+	}
+#     endif
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Returns TRUE if the file system st_dev keeps POSIX link counts on directories. The first time a file system is seen,
+// its type is looked up from path, a directory on it. This only happens for the start points and for mount points,
+// since a subdirectory on the same file system as its parent goes by the link count of the parent, see handle_dirent().
+static boolean devfs_posix(
+	unsigned long st_dev,
+	const char *path)
+{
+	boolean posix;
+	unsigned i;
+
+	pthread_mutex_lock(&devfs_lock);
+	for (i = 0; i < devfs_cnt; i++)
+		if (devfs_arr[i].st_dev == st_dev) {
+			posix = devfs_arr[i].posix;
+			pthread_mutex_unlock(&devfs_lock);
+			return posix;
+		}
+	pthread_mutex_unlock(&devfs_lock);
+
+	posix = devfs_probe(path); // - statfs() may take a while on a remote file system, so it is done unlocked
+
+	pthread_mutex_lock(&devfs_lock);
+	for (i = 0; i < devfs_cnt && devfs_arr[i].st_dev != st_dev; i++)
+		;
+	if (i == devfs_cnt) {
+		if (devfs_cnt == devfs_size) {
+			devfs_size = devfs_size ? devfs_size * 2 : 8;
+			devfs_arr = realloc(devfs_arr, devfs_size * sizeof(*devfs_arr));
+			assert(devfs_arr);
+		}
+		devfs_arr[devfs_cnt].st_dev = st_dev;
+		devfs_arr[devfs_cnt++].posix = posix;
+	} else
+		posix = devfs_arr[i].posix; // - another thread got here first, or found the file system non-compliant meanwhile
+	pthread_mutex_unlock(&devfs_lock);
+	return posix;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// A directory with a link count below 2 has been seen on the file system st_dev, so its link counts can't be trusted.
+static void devfs_noncompliant(
+	unsigned long st_dev)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&devfs_lock);
+	for (i = 0; i < devfs_cnt; i++)
+		if (devfs_arr[i].st_dev == st_dev)
+			devfs_arr[i].posix = FALSE;
+	pthread_mutex_unlock(&devfs_lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+#include "commonlib.h"
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Used by walk_dir:
+static inline void handle_dirent(threadlocal_t *, dirlist_t *, char *, unsigned char, prefetch_t *);
+static inline enum inline_reason inline_wanted(threadlocal_t *, dirlist_t *);
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Make room for a path of length len in the thread's path buffer.
+static inline __attribute__((always_inline)) void pathbuf_reserve(
+	threadlocal_t *tl,
+	size_t len)
+{
+	if (len < tl->pathbuf_size)
+		return;
+	while (len >= tl->pathbuf_size)
+		tl->pathbuf_size *= 2;
+	tl->pathbuf = realloc(tl->pathbuf, tl->pathbuf_size);
+	assert(tl->pathbuf);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// The path of the directory being processed is always kept at the start of the thread's path buffer,
+// and the path of the current entry is built right after it.
+// Since the buffer may be realloc'ed when a subdirectory is processed in-line, it must be fetched again after that.
+static inline __attribute__((always_inline)) char *curdir_path(
+	threadlocal_t *tl,
+	dirlist_t *curdir)
+{
+	tl->pathbuf[curdir->dirpath_len] = '\0';
+	return tl->pathbuf;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// When stopping (option -C), each thread saves the directories it was processing itself, along with where it left them.
+static inline __attribute__((always_inline)) void checkpoint_unfinished(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	off_t pos)
+{
+	checkpoint_add(&tl->stopbuf, 'P', curdir->depth, pos, curdir_path(tl, curdir), curdir->dirpath_len);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Chown a directory when all its entries have been handled. fd is only used with option -A.
+static inline __attribute__((always_inline)) void chown_dir(
+	threadlocal_t *tl,
+	int fd,
+	const char *dirpath,
+	const uid_t uid,
+	const gid_t gid)
+{
+	uid_t nuid;
+	gid_t ngid;
+
+	if (! dryrun) {
+		if (! filetypemask || (filetypemask&FILETYPE_DIR)) {
+			if (new_owner(uid, gid, &nuid, &ngid, tl)) {
+#			      if defined(AT_SYMLINK_NOFOLLOW)
+				if (at_calls)
+					do_chownat(tl, fd, NULL, nuid, ngid);
+				else
+#			      endif
+				do_chown(tl, dirpath, nuid, ngid);
+			} else if (skip_unchanged)
+				tl->stats.entries_unchanged++;
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Drop a reference to a split directory, and chown it if this was the last one.
+static inline __attribute__((always_inline)) void dirshare_release(
+	threadlocal_t *tl,
+	dirshare_t *share)
+{
+	unsigned refcnt;
+
+#     if defined(PR_ATOMIC_ADD)
+	refcnt = PR_ATOMIC_ADD(&share->refcnt, -1);
+#     else
+	pthread_mutex_lock(&dirshare_lock);
+	refcnt = --share->refcnt;
+	pthread_mutex_unlock(&dirshare_lock);
+#     endif
+	if (refcnt)
+		return;
+
+	chown_dir(tl, share->dirfd, share->dirpath, share->st_uid, share->st_gid);
+	if (share->dirfd >= 0)
+		close(share->dirfd);
+	free(share);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Queue a batch of entries from a split directory for the other threads.
+static inline __attribute__((always_inline)) void dirbatch_queue(
+	threadlocal_t *tl,
+	dirlist_t *node)
+{
+#     if defined(PR_ATOMIC_ADD)
+	PR_ATOMIC_ADD(&node->batch->share->refcnt, 1);
+#     else
+	pthread_mutex_lock(&dirshare_lock);
+	node->batch->share->refcnt++;
+	pthread_mutex_unlock(&dirshare_lock);
+#     endif
+	dirlist_enqueue(node);
+	tl->stats.batches++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) void chowndir_retain(
+	chowndir_t *dir)
+{
+#     if defined(PR_ATOMIC_ADD)
+	PR_ATOMIC_ADD(&dir->refcnt, 1);
+#     else
+	pthread_mutex_lock(&chown_lock);
+	dir->refcnt++;
+	pthread_mutex_unlock(&chown_lock);
+#     endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Drop a reference to a directory with entries handed to the chown threads, and free it if this was the last one.
+static inline __attribute__((always_inline)) void chowndir_release(
+	chowndir_t *dir)
+{
+	unsigned refcnt;
+
+#     if defined(PR_ATOMIC_ADD)
+	refcnt = PR_ATOMIC_ADD(&dir->refcnt, -1);
+#     else
+	pthread_mutex_lock(&chown_lock);
+	refcnt = --dir->refcnt;
+	pthread_mutex_unlock(&chown_lock);
+#     endif
+	if (refcnt)
+		return;
+	if (dir->dirfd >= 0)
+		close(dir->dirfd);
+	free(dir);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Put a batch of entries in the ring of this thread, for the chown threads (option --chown-threads).
+// The ring has a single producer, its owner, so only taking a batch from it needs a compare-and-swap.
+// If the ring is full, the thread waits for room, which keeps the reading from running too far ahead of the chowning.
+static void chown_put(
+	threadlocal_t *tl,
+	chownbatch_t *batch)
+{
+	unsigned pending;
+
+	if (checkpoint_file) {
+		// - Listed before the thread reading the directory is done with it, so the entries are in every checkpoint until done.
+		pthread_mutex_lock(&chownbatch_lock);
+		batch->prev = NULL;
+		if ((batch->next = chownbatch_live))
+			chownbatch_live->prev = batch;
+		chownbatch_live = batch;
+		pthread_mutex_unlock(&chownbatch_lock);
+	}
+
+	if (tl->chown_head - tl->chown_tail >= CHOWN_RING_SIZE) {
+		tl->stats.chown_ring_full++;
+		pthread_mutex_lock(&chown_lock);
+		chown_room_waiters++;
+#	      if defined(PR_ATOMIC_ADD)
+		__sync_synchronize(); // - pairs with the compare-and-swap in chown_take(), so either side sees the other
+#	      endif
+		while (tl->chown_head - tl->chown_tail >= CHOWN_RING_SIZE)
+			pthread_cond_wait(&chown_room_cond, &chown_lock);
+		chown_room_waiters--;
+		pthread_mutex_unlock(&chown_lock);
+	}
+
+#     if defined(PR_ATOMIC_ADD)
+	tl->chown_ring[tl->chown_head % CHOWN_RING_SIZE] = batch;
+	__sync_synchronize(); // - the batch is in place before the chown threads can see it
+	tl->chown_head++;
+	pending = PR_ATOMIC_ADD(&chown_pending, 1); // - also pairs with the check of chown_pending in chown_routine()
+#     else
+	pthread_mutex_lock(&chown_lock);
+	tl->chown_ring[tl->chown_head % CHOWN_RING_SIZE] = batch;
+	tl->chown_head++;
+	pending = ++chown_pending;
+	pthread_mutex_unlock(&chown_lock);
+#     endif
+	tl->stats.chown_handoffs++;
+	tl->stats.chown_occupancy += pending;
+	if (pending > chown_pending_peak)
+		chown_pending_peak = pending; // - may miss a peak now and then, it's just for -S
+
+	if (chown_sleepers) {
+		pthread_mutex_lock(&chown_lock);
+		pthread_cond_signal(&chown_work_cond);
+		pthread_mutex_unlock(&chown_lock);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Take the oldest batch from the ring of thread owner, or return NULL if it is empty.
+static inline __attribute__((always_inline)) chownbatch_t *chown_take(
+	threadlocal_t *owner)
+{
+	chownbatch_t *batch;
+	unsigned long tail;
+
+#     if defined(PR_ATOMIC_ADD)
+	// - If another chown thread took the batch first, the owner may have reused its slot, but then the tail has moved,
+	//   and the compare-and-swap fails.
+	do {
+		if ((tail = owner->chown_tail) == owner->chown_head)
+			return NULL;
+		__sync_synchronize(); // - pairs with the one in chown_put()
+		batch = owner->chown_ring[tail % CHOWN_RING_SIZE];
+	} while (! __sync_bool_compare_and_swap(&owner->chown_tail, tail, tail + 1));
+	PR_ATOMIC_ADD(&chown_pending, -1);
+#     else
+	pthread_mutex_lock(&chown_lock);
+	if ((tail = owner->chown_tail) == owner->chown_head) {
+		pthread_mutex_unlock(&chown_lock);
+		return NULL;
+	}
+	batch = owner->chown_ring[tail % CHOWN_RING_SIZE];
+	owner->chown_tail = tail + 1;
+	chown_pending--;
+	pthread_mutex_unlock(&chown_lock);
+#     endif
+
+	if (chown_room_waiters) {
+		pthread_mutex_lock(&chown_lock);
+		pthread_cond_broadcast(&chown_room_cond);
+		pthread_mutex_unlock(&chown_lock);
+	}
+	return batch;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Add an entry of curdir to be chown()'ed by the chown threads (option --chown-threads).
+// The entries are collected in a batch per directory, which is handed off when full, or when the directory is done.
+static inline __attribute__((always_inline)) void chown_handoff(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	const char *name,
+	unsigned char d_type,
+	uid_t uid,
+	gid_t gid)
+{
+	chownbatch_t *batch = curdir->chowns;
+	chowndir_t *dir = curdir->chowndir;
+	unsigned len = strlen(name) + 1;
+	char *e;
+
+	if (! dir) {
+		dir = curdir->chowndir = malloc(sizeof(chowndir_t) + curdir->dirpath_len + 1);
+		assert(dir);
+		dir->refcnt = 1;
+		dir->dirfd = -1;
+#	      if defined(AT_SYMLINK_NOFOLLOW)
+		// - The batches may outlive the directory handle of the thread reading the directory.
+		//   If dup() fails, the chown threads just use the path instead.
+		if (at_calls)
+			dir->dirfd = dup(curdir->dirfd);
+#	      endif
+		dir->depth = curdir->depth;
+		dir->dirpath_len = curdir->dirpath_len;
+		memcpy(dir->dirpath, tl->pathbuf, curdir->dirpath_len); // - not curdir_path(), which would cut off the path of the entry
+		dir->dirpath[curdir->dirpath_len] = '\0';
+	}
+
+	if (batch && batch->len + sizeof(uid_t) + sizeof(gid_t) + 1 + len > CHOWN_BATCH_BYTES) {
+		chown_put(tl, batch);
+		batch = NULL;
+	}
+	if (! batch) {
+		batch = curdir->chowns = malloc(sizeof(chownbatch_t));
+		assert(batch);
+		batch->dir = dir;
+		batch->cnt = 0;
+		batch->len = 0;
+		chowndir_retain(dir);
+	}
+
+	e = batch->entries + batch->len;
+	memcpy(e, &uid, sizeof(uid_t));
+	memcpy(e + sizeof(uid_t), &gid, sizeof(gid_t));
+	e[sizeof(uid_t) + sizeof(gid_t)] = d_type; // - for a checkpoint
+	memcpy(e + sizeof(uid_t) + sizeof(gid_t) + 1, name, len);
+	batch->len += sizeof(uid_t) + sizeof(gid_t) + 1 + len;
+	batch->cnt++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Hand off what is left of the entries of curdir when done with it, and drop the directory's own reference.
+// This is done when stopping as well, since the chown threads finish all the batches handed off.
+static inline __attribute__((always_inline)) void chown_flush(
+	threadlocal_t *tl,
+	dirlist_t *curdir)
+{
+	if (curdir->chowns) {
+		chown_put(tl, curdir->chowns);
+		curdir->chowns = NULL;
+	}
+	if (curdir->chowndir) {
+		chowndir_release(curdir->chowndir);
+		curdir->chowndir = NULL;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Chown the entries of a batch taken from a ring, relative to the open directory with option -A, or else by path.
+static void chown_batch(
+	threadlocal_t *tl,
+	chownbatch_t *batch)
+{
+	chowndir_t *dir = batch->dir;
+	unsigned path_len = dir->dirpath_len, name_len;
+	char *entry, *name;
+	uid_t uid;
+	gid_t gid;
+
+	pathbuf_reserve(tl, path_len + 1);
+	memcpy(tl->pathbuf, dir->dirpath, path_len);
+	if (! (path_len == 1 && dir->dirpath[0] == '/')) // - only add / if path != /
+		tl->pathbuf[path_len++] = '/';
+
+	for (entry = batch->entries; entry < batch->entries + batch->len; entry = name + name_len + 1) {
+		memcpy(&uid, entry, sizeof(uid_t));
+		memcpy(&gid, entry + sizeof(uid_t), sizeof(gid_t));
+		name = entry + sizeof(uid_t) + sizeof(gid_t) + 1;
+		name_len = strlen(name);
+#	      if defined(AT_SYMLINK_NOFOLLOW)
+		if (dir->dirfd >= 0) {
+			do_chownat(tl, dir->dirfd, name, uid, gid);
+			continue;
+		}
+#	      endif
+		pathbuf_reserve(tl, path_len + name_len);
+		memcpy(tl->pathbuf + path_len, name, name_len + 1);
+		do_chown(tl, tl->pathbuf, uid, gid);
+	}
+	tl->stats.chown_entries += batch->cnt;
+	if (checkpoint_file) {
+		pthread_mutex_lock(&chownbatch_lock);
+		if (batch->prev)
+			batch->prev->next = batch->next;
+		else
+			chownbatch_live = batch->next;
+		if (batch->next)
+			batch->next->prev = batch->prev;
+		pthread_mutex_unlock(&chownbatch_lock);
+	}
+	chowndir_release(dir);
+	free(batch);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// This is the routine used in every chown thread (option --chown-threads). It drains the rings of the reading threads,
+// starting with a ring of its own choice, and sleeps when they are all empty.
+static void *chown_routine(
+	void *id) // - has to be void *
+{
+	threadlocal_t *tl = &threadlocal_arr[thread_cnt + 1 + (unsigned long)id];
+	chownbatch_t *batch = NULL;
+	unsigned i = (unsigned long)id % thread_cnt, n;
+
+	pthread_setspecific(threadlocal_key, tl);
+
+	while (TRUE) {
+		for (n = 0; n < thread_cnt; n++, i = (i + 1) % thread_cnt)
+			if ((batch = chown_take(&threadlocal_arr[i])))
+				break;
+		if (batch) {
+			chown_batch(tl, batch);
+			continue;
+		}
+
+		pthread_mutex_lock(&chown_lock);
+		chown_sleepers++;
+#	      if defined(PR_ATOMIC_ADD)
+		__sync_synchronize(); // - pairs with the increment of chown_pending in chown_put(), so either side sees the other
+#	      endif
+		if (! chown_pending) {
+			if (chown_finished) {
+				chown_sleepers--;
+				pthread_mutex_unlock(&chown_lock);
+				break;
+			}
+			pthread_cond_wait(&chown_work_cond, &chown_lock);
+		}
+		chown_sleepers--;
+		pthread_mutex_unlock(&chown_lock);
+	}
+
+	if (debug)
+		fprintf(stderr, "Ending chown_routine(%lu)\n", (unsigned long)id);
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Give each reading thread its ring, and start the pool of chown threads (option --chown-threads).
+static void chown_stage_start()
+{
+	unsigned long i;
+	int rc;
+
+	for (i = 0; i < thread_cnt; i++) {
+		threadlocal_arr[i].chown_ring = malloc(CHOWN_RING_SIZE * sizeof(chownbatch_t *));
+		assert(threadlocal_arr[i].chown_ring);
+	}
+	chown_arr = calloc(chown_threads, sizeof(pthread_t));
+	assert(chown_arr);
+	for (i = 0; i < chown_threads; i++) {
+		rc = pthread_create(&chown_arr[i], NULL, chown_routine, (void *)i);
+		assert(rc == 0);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Once all the reading threads are done, let the chown threads finish the batches left in the rings, and wait for them.
+// This is done when stopping too, so the final checkpoint doesn't have to process their directories all over again.
+static void chown_stage_finish()
+{
+	unsigned i;
+
+	pthread_mutex_lock(&chown_lock);
+	chown_finished = TRUE;
+	pthread_cond_broadcast(&chown_work_cond);
+	pthread_mutex_unlock(&chown_lock);
+
+	for (i = 0; i < chown_threads; i++)
+		pthread_join(chown_arr[i], NULL);
+	free(chown_arr);
+	for (i = 0; i < thread_cnt; i++)
+		free(threadlocal_arr[i].chown_ring);
+	chown_end_usec = run_usec();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Allocate an empty batch of entries from the split directory share->dirpath, with room for size bytes of entries.
+static dirlist_t *dirbatch_new(
+	threadlocal_t *tl,
+	dirshare_t *share,
+	unsigned len,
+	unsigned depth,
+	unsigned st_nlink,
+	unsigned long st_dev,
+	ino_t st_ino,
+	unsigned size)
+{
+	dirlist_t *node = dirlist_alloc(tl, len);
+
+	memcpy(node->name, share->dirpath, len + 1); // - the whole path, since the share may be gone before a checkpoint is done with the node
+	node->name_len = len;
+	node->dirpath_len = len;
+	node->depth = depth;
+	node->inlined = 0;
+	node->subdirs = 0; // - just counts the subdirs in this batch, which is less than or equal to the truth
+	node->filecnt = 0;
+	node->st_nlink = st_nlink;
+	node->st_size = 0;
+	node->st_dev = st_dev;
+	node->st_uid = share->st_uid;
+	node->st_gid = share->st_gid;
+	node->st_ino = st_ino;
+	node->dirfd = -1;
+	node->unchanged = FALSE;
+	if (size < BATCH_BUF_SIZE)
+		size = BATCH_BUF_SIZE;
+	node->batch = malloc(sizeof(dirbatch_t) + size);
+	assert(node->batch);
+	node->batch->share = share;
+	node->batch->cnt = 0;
+	node->batch->len = 0;
+	node->batch->size = size;
+	return node;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Used by walk_dir when a directory has more than batch_threshold entries (option -B).
+// The entry is added to the batch being filled, and a full batch is queued for the other threads.
+// Returns FALSE if the directory could not be split, and the entry has to be handled right away.
+static boolean dirbatch_add(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	dirshare_t **sharep,
+	dirlist_t **nodep,
+	char *name,
+	unsigned char d_type)
+{
+	dirshare_t *share = *sharep;
+	dirlist_t *node = *nodep;
+	dirbatch_t *batch;
+	unsigned len = strlen(name) + 1;
+
+	if (! share) {
+		share = malloc(sizeof(dirshare_t) + curdir->dirpath_len + 1);
+		assert(share);
+		share->dirfd = -1;
+#	      if defined(AT_SYMLINK_NOFOLLOW)
+		// - The batches may outlive the directory handle of the thread reading the directory.
+		if (at_calls && (share->dirfd = dup(curdir->dirfd)) < 0) {
+			free(share);
+			return FALSE;
+		}
+#	      endif
+		share->refcnt = 1;
+		share->st_uid = curdir->st_uid;
+		share->st_gid = curdir->st_gid;
+		memcpy(share->dirpath, curdir_path(tl, curdir), curdir->dirpath_len + 1);
+		*sharep = share;
+		tl->stats.dirs_split++;
+	}
+
+	if (! node)
+		node = *nodep = dirbatch_new(tl, share, curdir->dirpath_len, curdir->depth, curdir->st_nlink, curdir->st_dev, curdir->st_ino, 0);
+
+	batch = node->batch;
+	if (batch->len + len + 1 > batch->size) {
+		while (batch->len + len + 1 > batch->size)
+			batch->size *= 2;
+		batch = node->batch = realloc(batch, sizeof(dirbatch_t) + batch->size);
+		assert(batch);
+	}
+	batch->entries[batch->len++] = d_type;
+	memcpy(batch->entries + batch->len, name, len);
+	batch->len += len;
+
+	if (++batch->cnt < batch_threshold)
+		return TRUE;
+
+	if (share->refcnt > 2 * thread_cnt) {
+		// - Plenty of batches are waiting already, so handle this one here rather than buffering up the whole directory.
+		char *entry;
+		for (entry = batch->entries; entry < batch->entries + batch->len && ! stopping; entry += strlen(entry) + 1) {
+			d_type = *entry++;
+			handle_dirent(tl, curdir, entry, d_type, NULL);
+		}
+		if (stopping)
+			checkpoint_add_batch(&tl->stopbuf, curdir->depth, curdir_path(tl, curdir), curdir->dirpath_len,
+				entry, batch->entries + batch->len);
+		batch->cnt = 0;
+		batch->len = 0;
+	} else {
+		dirbatch_queue(tl, node);
+		*nodep = NULL;
+	}
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Queue the batches of entries saved in the checkpoint given with -R.
+// Each gets a share of its own, so the directory is chown()'ed when the batch is done.
+static void resume_queue_batches()
+{
+	threadlocal_t *tl = pthread_getspecific(threadlocal_key);
+	resume_batch_t *rb;
+	dirshare_t *share;
+	dirlist_t *node;
+	struct stat st;
+	unsigned i, len;
+	char *e;
+
+	for (i = 0; i < resume_batch_count; i++) {
+		rb = &resume_batches[i];
+		len = strlen(rb->dirpath);
+		if ((rb->depth > 1 ? lstat(rb->dirpath, &st) : stat(rb->dirpath, &st)) < 0) {
+			fprintf(stderr, "%s: ", progname);
+			perror(rb->dirpath);
+			continue;
+		}
+		share = malloc(sizeof(dirshare_t) + len + 1);
+		assert(share);
+		share->dirfd = -1;
+#	      if defined(AT_SYMLINK_NOFOLLOW)
+		if (at_calls && (share->dirfd = open(rb->dirpath, rb->depth > 1 ? O_RDONLY|O_DIRECTORY|O_NOFOLLOW : O_RDONLY|O_DIRECTORY)) < 0) {
+			fprintf(stderr, "%s: ", progname);
+			perror(rb->dirpath);
+			free(share);
+			continue;
+		}
+#	      endif
+		share->refcnt = 0;
+		share->st_uid = st.st_uid;
+		share->st_gid = st.st_gid;
+		memcpy(share->dirpath, rb->dirpath, len + 1);
+
+		node = dirbatch_new(tl, share, len, rb->depth, devfs_posix(st.st_dev, rb->dirpath) ? st.st_nlink : DIRTY_CONSTANT,
+			st.st_dev, st.st_ino, rb->len);
+		memcpy(node->batch->entries, rb->entries, rb->len);
+		for (e = node->batch->entries; e < node->batch->entries + rb->len; e += strlen(e + 1) + 2) {
+			*e -= 'A';
+			node->batch->cnt++;
+		}
+		node->batch->len = rb->len;
+		dirbatch_queue(tl, node);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Handle a queued batch of entries from a split directory (option -B).
+static void walk_batch(
+	threadlocal_t *tl,
+	dirlist_t *curdir)
+{
+	dirbatch_t *batch = curdir->batch;
+	unsigned char d_type;
+	char *entry;
+
+	pathbuf_reserve(tl, curdir->dirpath_len);
+	memcpy(tl->pathbuf, curdir->name, curdir->dirpath_len);
+	curdir->dirfd = batch->share->dirfd;
+
+	for (entry = batch->entries; entry < batch->entries + batch->len && ! stopping; entry += strlen(entry) + 1) {
+		d_type = *entry++;
+		handle_dirent(tl, curdir, entry, d_type, NULL);
+	}
+	if (chown_threads)
+		chown_flush(tl, curdir);
+
+	// - If all the entries were handled before the stop was noticed, the batch is finished as usual,
+	// since there would be nothing left in the checkpoint to chown the directory itself.
+	if (stopping && entry < batch->entries + batch->len) {
+		checkpoint_add_batch(&tl->stopbuf, curdir->depth, curdir_path(tl, curdir), curdir->dirpath_len,
+			entry, batch->entries + batch->len);
+		return;
+	}
+	dirshare_release(tl, batch->share);
+	free(batch);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+#if defined(HAVE_IO_URING)
+/////////////////////////////////////////////////////////////////////////////
+
+// Set up the thread's io_uring instance the first time it is needed, and tell whether it can be used (option --io-uring).
+// If the kernel doesn't support it, everything is done by the usual system calls, as without the option.
+static boolean uring_ready(
+	threadlocal_t *tl)
+{
+	if (tl->uring.state == URING_UNTRIED) {
+		// - Two requests (statx and openat) per entry looked ahead at, and as much again for the levels of in-line processing below.
+		tl->uring.state = uring_setup(&tl->uring, 4 * uring_depth) ? URING_READY : URING_FAILED;
+		if (tl->uring.state == URING_FAILED && ! uring_unavailable) {
+			uring_unavailable = TRUE;
+			if (debug)
+				fprintf(stderr, "io_uring with statx and openat is not available, errno = %i - using the usual system calls\n", errno);
+		}
+	}
+	return tl->uring.state == URING_READY;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Make statx requests for the buffered entries from entry ahead on, up to uring_depth entries beyond entry i, which is
+// about to be handled. Only entries that handle_dirent() would stat are requested: known subdirectories, and entries of
+// unknown type as long as the link count says there are subdirectories left to find. A subdirectory that would be
+// processed in-line as things stand (with option -A) is opened as well. Returns how far the entries have been looked at.
+static unsigned prefetch_ahead(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	entbuf_t *ib,
+	unsigned i,
+	unsigned ahead)
+{
+	uring_t *u = &tl->uring;
+	struct io_uring_sqe *sqe;
+	prefetch_t *pf;
+	unsigned char d_type;
+	char *entry, *target;
+	unsigned name_len, path_len;
+	int dfd;
+
+	if (ahead < i)
+		ahead = i; // - entry i was not looked at, since too many requests were in flight
+	uring_reap(u); // - requests of the levels above may be done, making room for more
+	for (; ahead < ib->cnt && ahead < i + uring_depth && u->inflight + 2 <= u->entries; ahead++) {
+		entry = ib->names + ib->ents[ahead].name;
+		d_type = *entry++;
+		pf = &ib->pf[ahead % uring_depth];
+		pf->stat_made = FALSE;
+		pf->open_res = -1;
+		if (d_type != DT_DIR && (d_type != DT_UNKNOWN || curdir->subdirs + 2 >= curdir->st_nlink))
+			continue;
+
+		if (at_calls) {
+			dfd = curdir->dirfd;
+			target = entry;
+		} else {
+			// - The path must stay put until the request is done, so it gets a copy of its own.
+			name_len = strlen(entry);
+			path_len = curdir->dirpath_len;
+			if (path_len + name_len + 2 > pf->path_size) {
+				pf->path_size = path_len + name_len + 2 > PATH_MAX ? path_len + name_len + 2 : PATH_MAX;
+				pf->path = realloc(pf->path, pf->path_size);
+				assert(pf->path);
+			}
+			memcpy(pf->path, tl->pathbuf, path_len);
+			if (! (path_len == 1 && pf->path[0] == '/')) // - only add / if path != /
+				pf->path[path_len++] = '/';
+			memcpy(pf->path + path_len, entry, name_len + 1);
+			dfd = AT_FDCWD;
+			target = pf->path;
+		}
+
+		sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = dfd;
+		sqe->addr = (unsigned long)target;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (unsigned long)&pf->stx;
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->user_data = (unsigned long)pf;
+		uring_commit(u);
+		pf->pending = 1;
+		pf->stat_made = TRUE;
+		tl->stats.uring_stats++;
+
+		if (at_calls && d_type == DT_DIR && (! maxdepth || curdir->depth < maxdepth) && inline_wanted(tl, curdir) >= INLINE_BASE) {
+			sqe = uring_get_sqe(u);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = dfd;
+			sqe->addr = (unsigned long)target;
+			sqe->open_flags = O_RDONLY|O_DIRECTORY|O_NOFOLLOW;
+			sqe->user_data = (unsigned long)pf | 1;
+			uring_commit(u);
+			pf->pending++;
+			tl->stats.uring_opens++;
+		}
+	}
+	if (u->unsubmitted)
+		uring_enter(u, FALSE);
+	return ahead;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Wait for the requests made for entry i, if any, and return its slot, or NULL if the entry was not stat'ed ahead.
+static prefetch_t *prefetch_wait(
+	threadlocal_t *tl,
+	entbuf_t *ib,
+	unsigned i,
+	unsigned ahead)
+{
+	prefetch_t *pf = &ib->pf[i % uring_depth];
+
+	if (i >= ahead || ! pf->stat_made)
+		return NULL;
+	while (pf->pending) {
+		uring_reap(&tl->uring);
+		if (pf->pending) {
+			tl->stats.uring_waits++;
+			uring_enter(&tl->uring, TRUE);
+		}
+	}
+	return pf;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// When a stop leaves entries i up to ahead unhandled, their requests still have to complete before the slots can be reused,
+// and any directory opened ahead is closed again.
+static void prefetch_drain(
+	threadlocal_t *tl,
+	entbuf_t *ib,
+	unsigned i,
+	unsigned ahead)
+{
+	prefetch_t *pf;
+
+	for (; i < ahead; i++)
+		if ((pf = prefetch_wait(tl, ib, i, ahead)) && pf->open_res >= 0) {
+			close(pf->open_res);
+			pf->open_res = -1;
+		}
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Handle the entries buffered by entbuf_add(), in ascending inode order with option -O, and with option --io-uring,
+// with the entries stat'ed ahead, so one thread keeps up to uring_depth of them in flight.
+// If a stop interrupts it, the entries not handled are saved as a batch for the final checkpoint,
+// so a resumed run may continue after the chunk, like it does after the entries handed out by option -B.
+static void entbuf_flush(
+	threadlocal_t *tl,
+	dirlist_t *curdir)
+{
+	unsigned level = tl->ent_level - 1, cnt, i, len;
+	entbuf_t *ib = &tl->entbuf[level];
+	char *entry, *rest, *p;
+	prefetch_t *pf = NULL;
+#     if defined(HAVE_IO_URING)
+	unsigned ahead = 0;	// - the entries before this one have been looked at by prefetch_ahead()
+	boolean prefetch = uring_depth && uring_ready(tl);
+
+	if (prefetch && ! ib->pf) {
+		ib->pf = calloc(uring_depth, sizeof(prefetch_t));
+		assert(ib->pf);
+	}
+#     endif
+
+	if (! ib->cnt)
+		return;
+	if (inode_order) {
+		inode_sort(ib);
+		tl->stats.inode_sorts++;
+	}
+	cnt = ib->cnt;
+	for (i = 0; i < cnt && ! stopping; i++) {
+		ib = &tl->entbuf[level]; // - in-line processing of a subdirectory may have moved the array of levels
+		entry = ib->names + ib->ents[i].name;
+#	      if defined(HAVE_IO_URING)
+		if (prefetch) {
+			ahead = prefetch_ahead(tl, curdir, ib, i, ahead);
+			pf = prefetch_wait(tl, ib, i, ahead);
+		}
+#	      endif
+		handle_dirent(tl, curdir, entry + 1, *entry, pf);
+#	      if defined(HAVE_IO_URING)
+		if (pf && pf->open_res >= 0) { // - opened ahead, but queued after all
+			close(pf->open_res);
+			tl->stats.uring_opens_unused++;
+		}
+#	      endif
+	}
+	if (inode_order)
+		tl->stats.inode_sorted += i;
+	ib = &tl->entbuf[level];
+#     if defined(HAVE_IO_URING)
+	if (prefetch)
+		prefetch_drain(tl, ib, i, ahead);
+#     endif
+
+	if (i < cnt) {
+		p = rest = malloc(ib->names_len);
+		assert(rest);
+		for (; i < cnt; i++) {
+			entry = ib->names + ib->ents[i].name;
+			len = strlen(entry + 1) + 2;
+			memcpy(p, entry, len);
+			p += len;
+		}
+		checkpoint_add_batch(&tl->stopbuf, curdir->depth, curdir_path(tl, curdir), curdir->dirpath_len, rest, p);
+		free(rest);
+	}
+	ib->cnt = 0;
+	ib->names_len = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static void walk_dir(
+	threadlocal_t *tl,
+	dirlist_t *curdir)
+{
+	DIR *dir = NULL;
+	char *dirpath;
+	int fd = -1;			// - used on Linux/*BSD with getdents, and everywhere with option -A
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+	kernel_dirent_t *kdent;		// - only used on Linux/*BSD with getdents
+	unsigned bpos = 0, nread = 0;	// - same
+#endif
+	struct dirent *dent = NULL;
+	char *name;
+	unsigned char d_type;
+	unsigned long long ino;
+	off_t pos = 0, next_pos = 0;	// - how far the directory has been handled, for the final checkpoint (option -C)
+	unsigned long entries = 0;	// - number of entries read so far, for option -B
+	dirshare_t *share = NULL;	// - set when the directory has been split into batches
+	dirlist_t *batch = NULL;	// - the batch currently being filled
+
+	if (curdir->batch) {
+		walk_batch(tl, curdir);
+		return;
+	}
+
+	// A queued directory has its path built from its name and its parent's path, while a directory processed in-line is there already.
+	if (curdir->name) {
+		pathbuf_reserve(tl, curdir->dirpath_len);
+		path_build(tl->pathbuf, curdir->parent, curdir->name, curdir->name_len, curdir->dirpath_len);
+	}
+	dirpath = curdir_path(tl, curdir);
+
+#     if defined(DEBUG2)
+	if (getenv("DEBUG2") && curdir->depth <= 2)
+		fprintf(stderr, "- opendir(%s)\n", dirpath);
+#     endif
+
+#    if defined(AT_SYMLINK_NOFOLLOW)
+	if (at_calls) {
+		// A subdirectory processed in-line has normally been opened by openat() in handle_dirent() already.
+		// Below the start point(s), symlinks are never followed.
+		if ((fd = curdir->dirfd) < 0
+		    && (fd = open(dirpath, curdir->depth > 1 ? O_RDONLY|O_DIRECTORY|O_NOFOLLOW : O_RDONLY|O_DIRECTORY)) < 0) {
+			pthread_mutex_lock(&perror_lock);
+			perror(dirpath);
+			pthread_mutex_unlock(&perror_lock);
+			return;
+		}
+		curdir->dirfd = fd;
+	}
+#    endif
+
+#    if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+	if (extreme_readdir) {
+		if (fd < 0 && (fd = open(dirpath, O_RDONLY | O_DIRECTORY)) < 0) {
+			pthread_mutex_lock(&perror_lock);
+			perror(dirpath);
+			pthread_mutex_unlock(&perror_lock);
+			return;
+		}
+		readdir_extreme_enter(tl, curdir->st_size);
+#	      if defined(__linux__)
+		// - Continue where a stopped run left the directory (option -R).
+		unsigned i;
+		if (resume_count && (i = resume_lookup(dirpath)) && resume_pos[i - 1]) {
+			if (lseek(fd, resume_pos[i - 1], SEEK_SET) >= 0)
+				pos = next_pos = resume_pos[i - 1];
+			else
+				(void) lseek(fd, 0, SEEK_SET);
+		}
+#	      endif
+	} else
+#    endif
+#    if defined(AT_SYMLINK_NOFOLLOW)
+	if (fd >= 0) {
+		if (! (dir = fdopendir(fd))) {
+			pthread_mutex_lock(&perror_lock);
+			perror(dirpath);
+			pthread_mutex_unlock(&perror_lock);
+			close(fd);
+			return;
+		}
+	} else
+#    endif
+	if (! (dir = opendir(dirpath))) {
+			pthread_mutex_lock(&perror_lock);
+			perror(dirpath);
+			pthread_mutex_unlock(&perror_lock);
+			return;
+	}
+
+	if (curdir->st_nlink < 2) {
+		if (debug)
+			fprintf(stderr, "POSIX non-compliance detected on %s - not trusting link counts on file system 0x%lx\n", dirpath, curdir->st_dev);
+		devfs_noncompliant(curdir->st_dev);
+		curdir->st_nlink = DIRTY_CONSTANT;
+	}
+
+	if (entbuf_used)
+		entbuf_enter(tl);
+
+	while (! stopping) {
+		if (! entbuf_used || ! tl->entbuf[tl->ent_level - 1].cnt)
+			pos = next_pos; // - every entry before this position has been handled (or handed out, with option -B)
+		//assert(dir); // - something is seriously wrong if dir == 0 here...
+#	      if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+		if (extreme_readdir) {
+			if (! (kdent = readdir_extreme(tl, fd, curdir_path(tl, curdir), &bpos, &nread)))
+				break;
+			name = kdent->d_name;
+			d_type = kdent->d_type;
+			ino = kdent->d_ino;
+#		      if defined(__linux__)
+			next_pos = kdent->d_off;
+#		      endif
+		} else
+#	      endif
+		{
+			if (! (dent = readdir(dir)))
+				break;
+			name = dent->d_name;
+			d_type = DIRENT_TYPE(dent);
+			ino = dent->d_ino;
+		}
+
+#	     if defined(DEBUG2)
+		if (getenv("DEBUG2") && curdir->depth <= 2)
+			fprintf(stderr, "- readdir(%s) done, dent=<%s>\n", curdir_path(tl, curdir), name);
+#	     endif
+
+		if (name[0] == '.' && 
+			(name[1] == 0 ||
+			(name[1] == '.' && name[2] == 0)))
+				continue;       // Skip "." and ".."
+
+#	      if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+		// - In an unchanged directory (option -s), only subdirectories are of interest.
+		if (curdir->unchanged && d_type != DT_DIR && d_type != DT_UNKNOWN)
+			continue;
+#	      endif
+
+		// - Entries beyond the first batch_threshold ones are handed to the other threads in batches.
+		if (batch_threshold && ! curdir->unchanged && ++entries > batch_threshold
+		    && dirbatch_add(tl, curdir, &share, &batch, name, d_type))
+			continue;
+
+		// - With option -O or --io-uring, the entries are handled a chunk at a time (in inode order, or stat'ed ahead),
+		// so the position only moves past a whole chunk.
+		// The entries kept by this thread when the directory is split (option -B) make up the last chunk.
+		if (entbuf_used) {
+			if (entbuf_add(tl, name, d_type, ino) || (batch_threshold && entries == batch_threshold)) {
+				entbuf_flush(tl, curdir);
+				pos = next_pos;
+			}
+			continue;
+		}
+
+		handle_dirent(tl, curdir, name, d_type, NULL);
+	}
+
+	if (entbuf_used) {
+		if (! stopping)
+			entbuf_flush(tl, curdir);
+		entbuf_leave(tl);
+	}
+	if (chown_threads)
+		chown_flush(tl, curdir);
+
+	if (stopping) {
+		checkpoint_unfinished(tl, curdir, pos);
+		if (batch)
+			checkpoint_add_batch(&tl->stopbuf, curdir->depth, curdir_path(tl, curdir), curdir->dirpath_len,
+				batch->batch->entries, batch->batch->entries + batch->batch->len);
+	} else if (share) {
+		// - The directory itself is chown()'ed by whoever finishes the last batch.
+		if (batch)
+			dirbatch_queue(tl, batch);
+		dirshare_release(tl, share);
+	} else if (curdir->unchanged)
+		tl->stats.dirs_unchanged++;
+	else
+		chown_dir(tl, fd, curdir_path(tl, curdir), curdir->st_uid, curdir->st_gid);
+
+#     if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+	if (extreme_readdir) {
+		close(fd);
+		tl->dents_level--;
+	} else
+#     endif
+		closedir(dir);
+
+	return;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Build dirpath/name for an entry in the current directory, right after the directory's path in the thread's path buffer.
+// Returns the path, and its length in *len.
+static inline __attribute__((always_inline)) char *dirent_path(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	const char *name,
+	unsigned *len)
+{
+	size_t name_len = strlen(name);
+	unsigned path_len = curdir->dirpath_len;
+
+	pathbuf_reserve(tl, path_len + 1 + name_len);
+	if (! (path_len == 1 && tl->pathbuf[0] == '/')) // - only add / if path != /
+		tl->pathbuf[path_len++] = '/';
+	memcpy(tl->pathbuf + path_len, name, name_len + 1);
+	*len = path_len + name_len;
+	return tl->pathbuf;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// lstat() a directory entry, relative to the open directory if option -A is given.
+static inline __attribute__((always_inline)) int dirent_lstat(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	const char *name,
+	const char *path,
+	struct stat *st)
+{
+	unsigned long long t0 = metaop_start(tl);
+	int rc;
+
+#     if defined(AT_SYMLINK_NOFOLLOW)
+	if (at_calls)
+		rc = fstatat(curdir->dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+	else
+#     endif
+	rc = lstat(path, st);
+	metaop_end(tl, t0);
+	return rc;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Fetch just the user/group of a directory entry, used by option -u, and with option -l also the link count and inode.
+// Where statx() is available, only these fields and the type are requested, which is cheaper than a full lstat() on e.g. NFS.
+static inline __attribute__((always_inline)) int dirent_owner(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	const char *name,
+	const char *path,
+	struct stat *st)
+{
+	int rc;
+
+	tl->stats.ownerstat_calls++;
+
+#     if defined(STATX_UID)
+	if (! statx_unsupported) {
+		struct statx stx;
+		unsigned long long t0 = metaop_start(tl);
+		unsigned mask = STATX_TYPE|STATX_UID|STATX_GID | (hardlinks ? STATX_NLINK|STATX_INO : 0);
+		if (at_calls)
+			rc = statx(curdir->dirfd, name, AT_SYMLINK_NOFOLLOW, mask, &stx);
+		else
+			rc = statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, mask, &stx);
+		metaop_end(tl, t0);
+		if (rc == 0) {
+			st->st_uid = stx.stx_uid;
+			st->st_gid = stx.stx_gid;
+			if (hardlinks) {
+				// - A file system that can't tell, gets a single link, so the file is just changed.
+				st->st_nlink = (stx.stx_mask & (STATX_NLINK|STATX_INO)) == (STATX_NLINK|STATX_INO) ? stx.stx_nlink : 1;
+				st->st_ino = stx.stx_ino;
+				st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+			}
+			return 0;
+		}
+		if (errno != ENOSYS)
+			return rc;
+		statx_unsupported = TRUE; // - glibc has it, but the kernel is older than 4.11
+	}
+#     endif
+	return dirent_lstat(tl, curdir, name, path, st);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+#if defined(HAVE_IO_URING)
+// Fill in the fields of st used by handle_dirent() and below, from a statx made through io_uring.
+static inline __attribute__((always_inline)) void statx_to_stat(
+	const struct statx *stx,
+	struct stat *st)
+{
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_ino = stx->stx_ino;
+	st->st_size = stx->stx_size;
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+
+#if defined(STATX_TYPE)
+// Fetch just the type of a directory entry into st_mode, when d_type is DT_UNKNOWN.
+// With nothing but the type requested, statx() doesn't have to revalidate the attributes, e.g. on NFS.
+static inline __attribute__((always_inline)) int dirent_type(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	const char *name,
+	const char *path,
+	struct stat *st)
+{
+	struct statx stx;
+	unsigned long long t0 = metaop_start(tl);
+	int rc;
+
+	if (at_calls)
+		rc = statx(curdir->dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx);
+	else
+		rc = statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx);
+	metaop_end(tl, t0);
+	if (rc == 0)
+		st->st_mode = stx.stx_mode & S_IFMT;
+	else if (errno == ENOSYS)
+		statx_unsupported = TRUE; // - the caller falls back to lstat()
+	return rc;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Decide whether the next subdirectory of curdir is processed in-line, or queued for another thread.
+// Option -I gives the base, from the link count on POSIX compliant file systems. Beyond that, all subdirs are processed
+// in-line (depth-first) when the queue holds plenty of work for the active threads already, or when --max-queued is reached,
+// which bounds the memory used by the queue. And they are all queued while any thread is idle, waiting for work.
+static inline __attribute__((always_inline)) enum inline_reason inline_wanted(
+	threadlocal_t *tl,
+	dirlist_t *curdir)
+{
+	unsigned queued = outstanding_dirs;
+	boolean base = inline_processing_threshold &&
+		(curdir->st_nlink < inline_processing_threshold + 2 ||				     // - posix compliant
+		(curdir->st_nlink == (unsigned)DIRTY_CONSTANT && curdir->inlined < inline_processing_threshold)); // - non-compliant (btrfs)
+
+	if (tl->inline_level < INLINE_MAX_LEVEL) { // - the recursion of walk_dir() is bounded, as is its getdents buffer per level
+		if (max_queued && queued >= max_queued)
+			return base ? INLINE_BASE : INLINE_FORCED;
+		if (queued >= INLINE_PLENTY_PER_THREAD * active_threads)
+			return base ? INLINE_BASE : INLINE_PLENTY;
+	}
+	if (! base)
+		return INLINE_NO;
+	return parked_thread_cnt ? INLINE_STARVING : INLINE_BASE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Option -E with a /: is path, or a directory it is in, one of exclude_paths?
+static inline __attribute__((always_inline)) boolean path_excluded(
+	const char *path)
+{
+	const exclude_node_t *node = &exclude_trie, *child;
+	const char *end;
+	unsigned len, lo, hi, mid;
+	int cmp;
+
+	for (;;) {
+		len = (end = strchr(path, '/')) ? (unsigned)(end - path) : strlen(path);
+		for (lo = 0, hi = node->child_count, child = NULL; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (! (cmp = memcmp(node->children[mid].name, path, len < node->children[mid].name_len ? len : node->children[mid].name_len)))
+				cmp = (int)node->children[mid].name_len - (int)len;
+			if (! cmp) {
+				child = &node->children[mid];
+				break;
+			}
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (! child)
+			return FALSE;
+		if (child->excluded)
+			return TRUE;
+		if (! end)
+			return FALSE;
+		node = child;
+		for (path = end + 1; *path == '/'; path++) // - a start point may be given as dir/ or with //
+			;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// path is only needed (and may be NULL otherwise) if there are full paths to skip.
+static inline __attribute__((always_inline)) boolean dir_excluded(
+	threadlocal_t *tl,
+	const char *name,
+	const char *path)
+{
+	unsigned i;
+
+	if (exclude_name_set)
+		for (i = str_hash(name) & exclude_name_mask; exclude_name_set[i]; i = (i + 1) & exclude_name_mask)
+			if (strcmp(exclude_names[exclude_name_set[i] - 1], name) == 0) {
+				if (debug) fprintf(stderr, "==> Skipping dir %s (%s)\n", name, exclude_names[exclude_name_set[i] - 1]);
+				tl->stats.dirs_excluded++;
+				return TRUE;         // - skip directories specified through -E
+			}
+
+	// - All -e patterns are matched in one go, unless they couldn't be combined. Then each is tried in turn.
+	if (exclude_regex && regexec(exclude_regex, name, 0, NULL, 0) == 0) {
+		if (debug)
+			for (i = 0; i < exclude_patterns_count; i++)
+				if (regexec(exclude_recomps[i], name, 0, NULL, 0) == 0) {
+					fprintf(stderr, "==> Skipping dir %s (%s)\n", name, exclude_patterns[i]);
+					break;
+				}
+		tl->stats.dirs_excluded++;
+		return TRUE;                 // - skip directories specified through -e
+	}
+	if (! exclude_regex)
+		for (i = 0; i < exclude_patterns_count; i++)
+			if (regexec(exclude_recomps[i], name, 0, NULL, 0) == 0) {
+				if (debug) fprintf(stderr, "==> Skipping dir %s (%s)\n", name, exclude_patterns[i]);
+				tl->stats.dirs_excluded++;
+				return TRUE;         // - skip directories specified through -e
+			}
+
+	if (exclude_paths_count && path_excluded(path)) {
+		if (debug) fprintf(stderr, "==> Skipping dir %s (full path)\n", path);
+		tl->stats.dirs_excluded++;
+		return TRUE;                 // - skip directories specified through -E with a full path
+	}
+	return FALSE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) unsigned long long hardlink_hash(
+	dev_t dev,
+	ino_t ino)
+{
+	unsigned long long h = (unsigned long long)ino ^ ((unsigned long long)dev << 47 | (unsigned long long)dev >> 17);
+
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL; // - splitmix64 finalizer
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Free slot i of a stripe, moving back the entries after it that would not be found anymore across the gap.
+static void hardlink_remove(
+	hardlink_stripe_t *s,
+	unsigned i)
+{
+	unsigned j = i, home;
+
+	for (;;) {
+		s->slots[i].links_left = 0;
+		for (;;) {
+			j = (j + 1) & s->mask;
+			if (! s->slots[j].links_left)
+				return;
+			home = hardlink_hash(s->slots[j].st_dev, s->slots[j].st_ino) & s->mask;
+			if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+				break; // - probing for slot j passes slot i
+		}
+		s->slots[i] = s->slots[j];
+		i = j;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Double the size of a stripe, or allocate it the first time. Returns FALSE if that would exceed --hardlink-memory.
+static boolean hardlink_grow(
+	hardlink_stripe_t *s)
+{
+	unsigned size = s->slots ? (s->mask + 1) * 2 : HARDLINK_MIN_SLOTS;
+	hardlink_t *slots;
+	unsigned i, j, mask;
+
+	if (hardlink_max_slots && size > hardlink_max_slots) {
+		if (s->slots)
+			return FALSE;
+		size = hardlink_max_slots;
+	}
+	slots = calloc(size, sizeof(*slots));
+	assert(slots);
+	mask = size - 1;
+	if (s->slots) {
+		for (i = 0; i <= s->mask; i++)
+			if (s->slots[i].links_left) {
+				for (j = hardlink_hash(s->slots[i].st_dev, s->slots[i].st_ino) & mask; slots[j].links_left; j = (j + 1) & mask)
+					;
+				slots[j] = s->slots[i];
+			}
+		free(s->slots);
+	}
+	s->slots = slots;
+	s->mask = mask;
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Option -l: look up a file with more than one link, and return TRUE if it was found through another link already,
+// so it is changed already. Otherwise it is recorded, unless the set is full.
+static boolean hardlink_seen(
+	threadlocal_t *tl,
+	const struct stat *st)
+{
+	unsigned long long h = hardlink_hash(st->st_dev, st->st_ino);
+	hardlink_stripe_t *s = &hardlink_set[h >> (64 - HARDLINK_STRIPE_BITS)];
+	unsigned i;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->slots)
+		for (i = h & s->mask; s->slots[i].links_left; i = (i + 1) & s->mask)
+			if (s->slots[i].st_ino == st->st_ino && s->slots[i].st_dev == st->st_dev) {
+				if (--s->slots[i].links_left == 0) { // - the last link, the file won't be found again
+					hardlink_remove(s, i);
+					s->count--;
+				}
+				pthread_mutex_unlock(&s->lock);
+				return TRUE;
+			}
+
+	if ((s->slots && (s->count + 1) * 4 <= (s->mask + 1) * 3) || hardlink_grow(s)) {
+		for (i = h & s->mask; s->slots[i].links_left; i = (i + 1) & s->mask)
+			;
+		s->slots[i].st_dev = st->st_dev;
+		s->slots[i].st_ino = st->st_ino;
+		s->slots[i].links_left = st->st_nlink - 1 < UINT_MAX ? st->st_nlink - 1 : UINT_MAX;
+		s->count++;
+		tl->stats.hardlinks_recorded++;
+	} else
+		tl->stats.hardlinks_unrecorded++;
+	pthread_mutex_unlock(&s->lock);
+	return FALSE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// pf is set if the entry has been stat'ed ahead (option --io-uring), see entbuf_flush().
+static inline __attribute__((always_inline)) void handle_dirent(
+	threadlocal_t *tl,
+	dirlist_t *curdir,
+	char *name,
+	unsigned char d_type,
+	prefetch_t *pf)
+{
+	boolean dive_into_subdir = FALSE;
+	enum inline_reason inline_subdir;
+	int rc;
+	struct stat st;
+	char *path = NULL;	// - points into the thread's path buffer when set
+	unsigned path_len = 0;
+	int subdirfd = -1;	// - subdirectory opened by openat() for in-line processing, only with option -A
+	uid_t nuid;		// - new user/group of the entry
+	gid_t ngid;
+	st.st_dev = 0;
+	st.st_nlink = 0;	// - no link count yet
+	st.st_uid = -1;
+	st.st_gid = -1;
+
+	tl->stats.entries++;
+
+	// Getting path - with option -A it is only needed for directories, -n and messages
+#     if defined(AT_SYMLINK_NOFOLLOW)
+	if (! at_calls || dryrun || debug)
+#     endif
+		path = dirent_path(tl, curdir, name, &path_len);
+
+#     if defined(DEBUG2)
+	if (getenv("DEBUG2") && curdir->depth <= 2)
+		fprintf(stderr, "-> handle_dirent(): d_name=\"%s\" of dirpath=\"%.*s\" path=\"%s\", d_type=%i, n_link=%u\n",
+			name, (int)curdir->dirpath_len, tl->pathbuf, path ? path : "", d_type, curdir->st_nlink);
+#     endif
+
+	// Process up to n subdirs inline, n = inline_processing_threshold, or more or less depending on the queue, see inline_wanted().
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+	inline_subdir = d_type != DT_UNKNOWN && d_type != DT_DIR ? INLINE_NO : inline_wanted(tl, curdir); // - not for a known non-directory
+#else
+	inline_subdir = inline_wanted(tl, curdir);
+#endif
+
+	// Getting stat if there might be subdirs below
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+	// - With a POSIX link count, the entries left once st_nlink - 2 subdirs are found can't be directories, so there is
+	//   no need to stat an entry of unknown type to find out (nor for any entry at all if the link count is 2).
+	if (d_type == DT_UNKNOWN && curdir->subdirs + 2 >= curdir->st_nlink)
+		tl->stats.statcount_elided++;
+	else if (d_type == DT_DIR
+	   || d_type == DT_UNKNOWN) {
+		// We might get d_type == DT_UNKNOWN (0):
+		// - on directories we don't own ourselves.
+		// - on NFS shares.
+		// - on XFS without ftype.
+		if (debug)
+			fprintf(stderr, "handle_dirent(): lstat(%s) [nlink=%i]\n", path, curdir->st_nlink);
+#	      if defined(HAVE_IO_URING)
+		// - Stat'ed ahead through io_uring, and with option -A, a subdirectory to be processed in-line may be open already.
+		//   Unexpected errors (e.g. EINVAL from an odd file system) are left to the usual calls below.
+		if (pf && (pf->stat_res == 0 || pf->stat_res == -ENOENT || pf->stat_res == -EACCES)) {
+			if ((rc = pf->stat_res ? -1 : 0))
+				errno = -pf->stat_res;
+			else
+				statx_to_stat(&pf->stx, &st);
+			if (pf->open_res >= 0 && d_type == DT_DIR && inline_subdir >= INLINE_BASE && (! maxdepth || curdir->depth < maxdepth)) {
+				subdirfd = pf->open_res;
+				pf->open_res = -1;
+			}
+		} else
+#	      endif
+#	      if defined(AT_SYMLINK_NOFOLLOW)
+		// A known subdirectory to be processed in-line is opened right away, and fstat() on the descriptor
+		// replaces the lstat() here and the opendir() in walk_dir().
+		if (at_calls && d_type == DT_DIR && inline_subdir >= INLINE_BASE && (! maxdepth || curdir->depth < maxdepth)
+		    && (subdirfd = openat(curdir->dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) >= 0)
+			rc = fstat(subdirfd, &st);
+		else
+#	      endif
+#	      if defined(STATX_TYPE)
+		// - An entry of unknown type needs the full lstat() only if it turns out to be a directory.
+		if (d_type == DT_UNKNOWN && ! statx_unsupported
+		    && ((rc = dirent_type(tl, curdir, name, path, &st)) ? errno != ENOSYS : ! S_ISDIR(st.st_mode)))
+			;
+		else
+#	      endif
+		rc = dirent_lstat(tl, curdir, name, path, &st);
+		if (rc && errno == EACCES) {
+			if (! path)
+				path = dirent_path(tl, curdir, name, &path_len);
+			pthread_mutex_lock(&perror_lock);
+			perror(path);
+			pthread_mutex_unlock(&perror_lock);
+		}
+
+		if (d_type == DT_UNKNOWN) {
+			tl->stats.statcount_unexp++;
+
+			switch (st.st_mode & S_IFMT) {
+				case S_IFREG:
+					d_type = DT_REG;
+					break;
+				case S_IFDIR:
+					d_type = DT_DIR;
+					break;
+				case S_IFBLK:
+					d_type = DT_BLK;
+					break;
+				case S_IFCHR:
+					d_type = DT_CHR;
+					break;
+				case S_IFIFO:
+					d_type = DT_FIFO;
+					break;
+				case S_IFLNK:
+					d_type = DT_LNK;
+					break;
+				case S_IFSOCK:
+					d_type = DT_SOCK;
+					break;
+			}
+		} else
+			tl->stats.statcount++;
+	}
+
+	if (d_type == DT_DIR) {
+		dive_into_subdir = TRUE;
+		curdir->subdirs++;
+
+		if (xdev && curdir->st_dev != st.st_dev)
+			dive_into_subdir = FALSE;
+	}
+#else // - non-Linux/BSD goes here: // - non-Linux/BSD goes here:
+        if (curdir->subdirs + 2 < curdir->st_nlink) { // - the rest are no directories once st_nlink - 2 subdirs are found
+		tl->stats.statcount++;
+
+		rc = dirent_lstat(tl, curdir, name, path, &st);
+		if (rc && errno == EACCES) {
+			if (! path)
+				path = dirent_path(tl, curdir, name, &path_len);
+			pthread_mutex_lock(&perror_lock);
+			perror(path);
+			pthread_mutex_unlock(&perror_lock);
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			dive_into_subdir = TRUE;
+			curdir->subdirs++;
+
+			if (xdev && curdir->st_dev != st.st_dev)
+				dive_into_subdir = FALSE;
+		}
+	}
+#endif
+
+	if (dive_into_subdir) {
+		// - A subdirectory on the same file system goes by its parent, a mount point by its own file system.
+		if (curdir->st_dev == st.st_dev ? curdir->st_nlink == (unsigned)DIRTY_CONSTANT
+		    : ! devfs_posix(st.st_dev, path ? path : (path = dirent_path(tl, curdir, name, &path_len))))
+			st.st_nlink = DIRTY_CONSTANT;
+	}
+
+	if (dive_into_subdir && unchanged_since(&st) && st.st_nlink == 2) {
+		// - An unchanged directory without subdirectories (option -s) doesn't even have to be read.
+		dive_into_subdir = FALSE;
+		tl->stats.dirs_unread++;
+	}
+
+	if (dive_into_subdir) {
+		// - Directories queued on their own from the checkpoint (option -R) are skipped here.
+		if ((! maxdepth || curdir->depth < maxdepth)
+		    && (! excluding || ! dir_excluded(tl, name, ! exclude_paths_count ? NULL
+						: path ? path : (path = dirent_path(tl, curdir, name, &path_len))))
+		    && (! resume_count || ! resume_lookup(path ? path : (path = dirent_path(tl, curdir, name, &path_len))))) {
+			if (! path)
+				path = dirent_path(tl, curdir, name, &path_len);
+
+			if (dryrun
+			    && (! filetypemask || (filetypemask & FILETYPE_DIR))
+			    && ! unchanged_since(&st)) {
+				if ((! skip_unchanged && ! map_file) || new_owner(st.st_uid, st.st_gid, &nuid, &ngid, tl))
+					puts(path);
+				else if (skip_unchanged)
+					tl->stats.entries_unchanged++;
+			}
+
+			// - With option --dev-threads, a mount point is queued on its own file system, and counted against its limit.
+			if (inline_subdir >= INLINE_BASE && (! dev_threads || st.st_dev == curdir->st_dev)) {
+				curdir->inlined++;
+
+				dirlist_t subdirentry;
+
+				subdirentry.name = NULL; // - the path is in tl->pathbuf
+				subdirentry.name_len = strlen(name);
+				subdirentry.dirpath_len = path_len;
+				subdirentry.parent = NULL;
+				subdirentry.pnode = NULL;
+				subdirentry.inline_parent = curdir;
+				subdirentry.depth = curdir->depth+1;
+				subdirentry.inlined = 0;
+				subdirentry.subdirs = 0;
+				subdirentry.st_nlink = st.st_nlink;
+				subdirentry.st_dev = st.st_dev;
+				subdirentry.st_size = st.st_size;
+				subdirentry.st_uid = st.st_uid;
+				subdirentry.st_gid = st.st_gid;
+				subdirentry.filecnt = 0;
+				subdirentry.dirfd = subdirfd; // - closed by walk_dir()
+				subdirentry.batch = NULL;
+				subdirentry.chowns = NULL;
+				subdirentry.chowndir = NULL;
+				subdirentry.unchanged = unchanged_since(&st);
+				subdirfd = -1;
+
+				tl->stats.inlined_dirs++;
+				if (inline_subdir == INLINE_PLENTY)
+					tl->stats.inlined_plenty++;
+				else if (inline_subdir == INLINE_FORCED)
+					tl->stats.inlined_forced++;
+				tl->inline_level++;
+				walk_dir(tl, &subdirentry);
+				tl->inline_level--;
+				if (subdirentry.pnode)
+					pathnode_release(tl, subdirentry.pnode);
+			} else {
+				// - The first n subdirs, n <= inline_processing_threshold, will be enqueued and processed when a thread is available.
+				if (inline_subdir == INLINE_STARVING)
+					tl->stats.queued_starving++;
+				dirlist_add_dir(dir_pathnode(tl, curdir), name, path_len, curdir->depth+1, &st);
+			}
+		}
+	} else if ((! filetypemask || (filetypemask&FILETYPE_REGFILE)) && ! curdir->unchanged) {
+		boolean change = TRUE;
+
+		nuid = new_uid;
+		ngid = new_gid;
+		// - With option -l, a file with more than one link is only changed (or listed) through the first link found.
+		//   This comes first, so that all links are counted down, and the file is dropped from the set after the last one.
+		if (hardlinks && d_type != DT_DIR) {
+			if (! st.st_nlink)
+				(void) dirent_owner(tl, curdir, name, path, &st);
+			if (st.st_nlink > 1 && hardlink_seen(tl, &st)) {
+				change = FALSE;
+				tl->stats.hardlinks_skipped++;
+			}
+		}
+		if (change && (skip_unchanged || map_file)) {
+			// - With option -u or -M, fetch the ownership if we don't have it yet. The entry is left alone if it's already
+			//   correct, or if no mapping applies to it.
+			if (st.st_uid == (uid_t)-1 && st.st_gid == (gid_t)-1)
+				(void) dirent_owner(tl, curdir, name, path, &st);
+			if (! new_owner(st.st_uid, st.st_gid, &nuid, &ngid, tl)) {
+				change = FALSE;
+				if (skip_unchanged)
+					tl->stats.entries_unchanged++;
+			}
+		}
+
+                if (dryrun) {
+			if (change)
+                        	puts(path);
+                } else {
+			// - If we don't have an lstat() filled st struct so far, just set the new user/group instead of the more time consuming procedure of running lstat() and check old values.
+			if (change && ((st.st_uid >= 0 && st.st_uid != nuid) || (st.st_gid >= 0 && st.st_gid != ngid))) {
+				if (chown_threads)
+					chown_handoff(tl, curdir, name, d_type, nuid, ngid);
+				else
+#			      if defined(AT_SYMLINK_NOFOLLOW)
+				if (at_calls)
+					do_chownat(tl, curdir->dirfd, name, nuid, ngid);
+				else
+#			      endif
+				do_chown(tl, path, nuid, ngid);
+			}
+		}
+	}
+
+	if (subdirfd >= 0)
+		close(subdirfd);
+
+	return;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Option -D takes either a number of seconds from now, or a time of day HH:MM, today or tomorrow.
+// Returns 0 if the argument is invalid.
+static time_t parse_deadline(
+	const char *arg)
+{
+	time_t now = time(NULL), t;
+	unsigned hh, mm;
+	struct tm tm;
+	char c;
+
+	if (sscanf(arg, "%u:%u%c", &hh, &mm, &c) == 2) {
+		if (hh > 23 || mm > 59)
+			return 0;
+		(void) localtime_r(&now, &tm);
+		tm.tm_hour = hh;
+		tm.tm_min = mm;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		if ((t = mktime(&tm)) <= now) {
+			tm.tm_mday++;
+			tm.tm_isdst = -1;
+			t = mktime(&tm);
+		}
+		return t;
+	}
+	if (! *arg || strspn(arg, "0123456789") != strlen(arg) || atol(arg) < 1)
+		return 0;
+	return now + atol(arg);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Option -s takes either a time in seconds since the epoch, or a stamp file written by an earlier run, holding
+// "<uid>:<gid>" of that run, with the time it started as mtime.
+// Returns 0, so everything is examined, if the stamp file doesn't exist yet or was written for another user/group.
+static time_t since_load(
+	char *arg)
+{
+	unsigned long uid, gid;
+	unsigned long long hash = 0;
+	struct stat st;
+	FILE *fp;
+	int n;
+
+	if (*arg && strspn(arg, "0123456789") == strlen(arg))
+		return atol(arg);
+
+	stampfile = arg;
+	if (! (fp = fopen(stampfile, "r"))) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "%s: ", progname);
+			perror(stampfile);
+			exit(1);
+		}
+		fprintf(stderr, "%s: No stamp file %s yet - examining everything.\n", progname, stampfile);
+		return 0;
+	}
+	n = fscanf(fp, "%lu:%lu:%llx", &uid, &gid, &hash);
+	if (fstat(fileno(fp), &st) < 0) {
+		fprintf(stderr, "%s: ", progname);
+		perror(stampfile);
+		exit(1);
+	}
+	fclose(fp);
+
+	if (n < 2 || uid != (unsigned long)new_uid || gid != (unsigned long)new_gid) {
+		fprintf(stderr, "%s: Stamp file %s was written by a run with another user/group - examining everything.\n",
+			progname, stampfile);
+		return 0;
+	}
+	if ((n == 3 ? hash : 0) != map_hash) {
+		fprintf(stderr, "%s: Stamp file %s was written by a run with another ownership map (-M) - examining everything.\n",
+			progname, stampfile);
+		return 0;
+	}
+	return st.st_mtime;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Write the stamp file given with -s when the run has completed, with the time the run started as mtime,
+// so anything changed while running is examined by the next run.
+static void stamp_write()
+{
+	struct timeval tv[2];
+	char *tmpfile = malloc(strlen(stampfile) + 5);
+	FILE *fp;
+	int rc;
+
+	assert(tmpfile);
+	sprintf(tmpfile, "%s.tmp", stampfile);
+	if (! (fp = fopen(tmpfile, "w"))) {
+		fprintf(stderr, "%s: ", progname);
+		perror(tmpfile);
+		free(tmpfile);
+		return;
+	}
+	if (map_file)
+		rc = fprintf(fp, "%lu:%lu:%llx\n", (unsigned long)new_uid, (unsigned long)new_gid, map_hash) < 0;
+	else
+		rc = fprintf(fp, "%lu:%lu\n", (unsigned long)new_uid, (unsigned long)new_gid) < 0;
+	rc |= fclose(fp) != 0;
+
+	tv[0].tv_sec = tv[1].tv_sec = run_start;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	if (rc || utimes(tmpfile, tv) < 0 || rename(tmpfile, stampfile) < 0) {
+		fprintf(stderr, "%s: ", progname);
+		perror(stampfile);
+		(void) unlink(tmpfile);
+	}
+	free(tmpfile);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static idmap_range_t *idmap_sort_ranges; // - the ranges idmap_cmp() sorts indexes into
+
+static int idmap_cmp(
+	const void *a,
+	const void *b)
+{
+	unsigned long x = idmap_sort_ranges[*(const unsigned *)a].first, y = idmap_sort_ranges[*(const unsigned *)b].first;
+
+	return x < y ? -1 : x > y;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Set up the hash table of single id mappings and the sorted table of ranges, once all mappings are loaded.
+// The same id mapped twice, or overlapping ranges, are fatal.
+static void idmap_build(
+	idmap_t *map,
+	const char *file,
+	const char *kind)
+{
+	unsigned i, j, singles = 0, size;
+	idmap_range_t *r, *prev;
+
+	for (i = 0; i < map->count; i++)
+		if (map->ranges[i].first == map->ranges[i].last)
+			singles++;
 
-	if (curdir->st_nlink < 2 && ! simulate_posix_compliance) {
-		if (debug)	
-			fprintf(stderr, "POSIX non-compliance detected on %s - setting simulate_posix_compliance = TRUE\n", curdir->dirpath);
-		simulate_posix_compliance = TRUE;
-		curdir->st_nlink = DIRTY_CONSTANT;
+	if (singles) {
+		for (size = 16; size < 2 * singles; size *= 2)
+			;
+		map->hash = calloc(size, sizeof(*map->hash));
+		assert(map->hash);
+		map->hash_mask = size - 1;
 	}
+	map->intervals = malloc((map->count - singles + 1) * sizeof(*map->intervals));
+	assert(map->intervals);
 
-	while (TRUE) {
-		//assert(dir); // - something is seriously wrong if dir == 0 here...
-#	      if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-		if (extreme_readdir) {
-			readdir_extreme(fd, buf, buf_size, curdir->dirpath, &bpos, dent, &nread);
-			if (! nread) {
-				close(fd);
-				free(buf);
-				free(dent);
-				dent = NULL;
+	for (i = 0; i < map->count; i++) {
+		r = &map->ranges[i];
+		if (r->first != r->last) {
+			map->intervals[map->interval_count++] = i;
+			continue;
+		}
+		for (j = idmap_hash(r->first) & map->hash_mask; map->hash[j]; j = (j + 1) & map->hash_mask)
+			if (map->ranges[map->hash[j] - 1].first == r->first) {
+				fprintf(stderr, "%s: %s:%u: %s %lu is mapped on line %u already - bailing out.\n",
+					progname, file, r->line, kind, r->first, map->ranges[map->hash[j] - 1].line);
+				exit(1);
 			}
-		} else
-#	      endif
-		dent = readdir(dir);
+		map->hash[j] = i + 1;
+	}
 
-		if (dent == NULL)
-			break;
+	idmap_sort_ranges = map->ranges;
+	qsort(map->intervals, map->interval_count, sizeof(*map->intervals), idmap_cmp);
+	for (i = 1; i < map->interval_count; i++) {
+		prev = &map->ranges[map->intervals[i - 1]];
+		r = &map->ranges[map->intervals[i]];
+		if (r->first <= prev->last) {
+			fprintf(stderr, "%s: %s:%u: %s range %lu-%lu overlaps %lu-%lu on line %u - bailing out.\n",
+				progname, file, r->line, kind, r->first, r->last, prev->first, prev->last, prev->line);
+			exit(1);
+		}
+	}
+}
 
-#	     if defined(DEBUG2)
-		if (getenv("DEBUG2") && curdir->depth <= 2)
-			fprintf(stderr, "- readdir(%s) done, dent=<%s>\n", curdir->dirpath, dent->d_name);
-#	     endif
+/////////////////////////////////////////////////////////////////////////////
 
-		if (dent->d_name[0] == '.' && 
-			(dent->d_name[1] == 0 ||
-			(dent->d_name[1] == '.' && dent->d_name[2] == 0)))
-				continue;       // Skip "." and ".."
+// Load the ownership map given with -M. Each line maps a uid or a gid, or a range of them shifted to new_first:
+//	uid <old> <new>
+//	gid <first>-<last> <new_first>
+// Empty lines and lines starting with # are ignored. A single id takes precedence over a range containing it.
+static void idmap_load(
+	const char *file)
+{
+	unsigned long first, last, new_first;
+	unsigned lineno = 0, size[2] = { 0, 0 };
+	char line[256], kind[8], c, *p;
+	idmap_t *map;
+	FILE *fp;
+	int n;
 
-		handle_dirent(curdir, dent);
+	if (! (fp = fopen(file, "r"))) {
+		fprintf(stderr, "%s: ", progname);
+		perror(file);
+		exit(1);
 	}
+	map_hash = 14695981039346656037ULL; // - FNV-1a of the whole file, so a stamp or checkpoint of another map is recognized
+	while (fgets(line, sizeof(line), fp)) {
+		for (p = line; *p; p++)
+			map_hash = (map_hash ^ (unsigned char)*p) * 1099511628211ULL;
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || ! *p)
+			continue;
 
-#     if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-	if (! extreme_readdir)
-#     endif
-		closedir(dir);
+		// - Two fields means there was no range, so try a single id.
+		n = sscanf(p, "%7s %lu-%lu %lu %c", kind, &first, &last, &new_first, &c);
+		if (n == 2 && sscanf(p, "%7s %lu %lu %c", kind, &first, &new_first, &c) == 3) {
+			last = first;
+			n = 4;
+		}
+		if (n != 4 || (! strchr(p, '\n') && ! feof(fp))
+		    || (strcmp(kind, "uid") && strcmp(kind, "gid"))
+		    || last < first
+		    || last >= (unsigned long)(uid_t)-1
+		    || new_first + (last - first) >= (unsigned long)(uid_t)-1) {
+			fprintf(stderr, "%s: %s:%u: Bad mapping, expected \"uid|gid <old> <new>\" or \"uid|gid <first>-<last> <new_first>\" - bailing out.\n",
+				progname, file, lineno);
+			exit(1);
+		}
 
-	if (! dryrun) {
-		if (! filetypemask || (filetypemask&FILETYPE_DIR)) {
-			if ((new_uid >= 0 && new_uid != curdir->st_uid) || (new_gid >= 0 && new_gid != curdir->st_gid))
-				do_chown(curdir->dirpath, new_uid, new_gid);
+		map = *kind == 'u' ? &uid_map : &gid_map;
+		if (map->count == size[*kind == 'g']) {
+			size[*kind == 'g'] = size[*kind == 'g'] ? 2 * size[*kind == 'g'] : 256;
+			map->ranges = realloc(map->ranges, size[*kind == 'g'] * sizeof(*map->ranges));
+			assert(map->ranges);
 		}
+		map->ranges[map->count].first = first;
+		map->ranges[map->count].last = last;
+		map->ranges[map->count].new_first = new_first;
+		map->ranges[map->count].line = lineno;
+		map->count++;
 	}
+	fclose(fp);
 
-	if (curdir->dirpath)
-		free(curdir->dirpath);
-
-	return;
+	if (! uid_map.count && ! gid_map.count) {
+		fprintf(stderr, "%s: No mappings in %s - bailing out.\n", progname, file);
+		exit(1);
+	}
+	idmap_build(&uid_map, file, "uid");
+	idmap_build(&gid_map, file, "gid");
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline __attribute__((always_inline)) void handle_dirent(
-	dirlist_t *curdir,
-	struct dirent *dent)
+// Print the hit count of each mapping that was used, for -S. The counters of map start at offset in each thread's map_hits.
+static void idmap_print_stats(
+	idmap_t *map,
+	unsigned offset,
+	const char *kind)
 {
-	boolean dive_into_subdir = FALSE;
-	int rc, i;
-	struct stat st;
-	st.st_dev = 0;
-	st.st_uid = -1;
-	st.st_gid = -1;
-
-	// Getting path
-	size_t path_len = strlen(curdir->dirpath) + 1 + strlen(dent->d_name);
-	char *path = malloc(path_len+1);
-	assert(path);
-	strcpy(path, curdir->dirpath);
-	if (! (path[0] == '/' && path[1] == 0)) strcat(path, "/"); // - only add / if path != /
-	strcat(path, dent->d_name);
+	idmap_range_t *r;
+	unsigned long long *hits, total = 0;
+	unsigned i, j, unused = 0;
 
-#     if defined(DEBUG2)
-	if (getenv("DEBUG2") && curdir->depth <= 2)
-		fprintf(stderr, "-> handle_dirent(): d_name=\"%s\" of dirpath=\"%s\" path=\"%s\", d_type=%i, n_link=%u\n",
-			dent->d_name, curdir->dirpath, path, dent->d_type, curdir->st_nlink);
-#     endif
+	if (! map->count)
+		return;
+	hits = calloc(map->count, sizeof(*hits));
+	assert(hits);
+	for (j = 0; j <= thread_cnt + chown_threads; j++)
+		for (i = 0; i < map->count; i++)
+			hits[i] += threadlocal_arr[j].map_hits[offset + i];
+	for (i = 0; i < map->count; i++)
+		if (hits[i])
+			total += hits[i];
+		else
+			unused++;
+	fprintf(stderr, "- Number of entries with a %s mapped (-M): %llu, by %u of %u mappings\n", kind, total, map->count - unused, map->count);
+	for (i = 0; i < map->count; i++) {
+		r = &map->ranges[i];
+		if (! hits[i])
+			continue;
+		if (r->first == r->last)
+			fprintf(stderr, "  %s:%u: %s %lu -> %lu: %llu\n", map_file, r->line, kind, r->first, r->new_first, hits[i]);
+		else
+			fprintf(stderr, "  %s:%u: %s %lu-%lu -> %lu-%lu: %llu\n", map_file, r->line, kind, r->first, r->last,
+				r->new_first, r->new_first + (r->last - r->first), hits[i]);
+	}
+	free(hits);
+}
 
-	// Getting stat if there might be subdirs below
-#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
-	if (dent->d_type == DT_DIR
-	   || dent->d_type == DT_UNKNOWN) {
-		// We might get d_type == DT_UNKNOWN (0):
-		// - on directories we don't own ourselves.
-		// - on NFS shares.
-		if (debug)
-			fprintf(stderr, "handle_dirent(): lstat(%s) [nlink=%i]\n", path, curdir->st_nlink);
-		rc = lstat(path, &st);
-		if (rc && errno == EACCES) {
-			pthread_mutex_lock(&perror_lock);
-			perror(path);
-			pthread_mutex_unlock(&perror_lock);
-		}
+/////////////////////////////////////////////////////////////////////////////
 
-		if (dent->d_type == DT_UNKNOWN) {
-#                     if defined(PR_ATOMIC_ADD)
-                        PR_ATOMIC_ADD(&statcount_unexp, 1);
-#                     else
-                        pthread_mutex_lock(&statcount_unexp_lock);
-			statcount_unexp++;
-                        pthread_mutex_unlock(&statcount_unexp_lock);
-#                     endif
+// Add a directory to skip, given by name (-E, -Z), or by its full path when it has a /.
+static void exclude_add(
+	const char *rule)
+{
+	char *copy, *p, *q;
 
-			switch (st.st_mode & S_IFMT) {
-				case S_IFREG:
-					dent->d_type = DT_REG;
-					break;
-				case S_IFDIR:
-					dent->d_type = DT_DIR;
-					break;
-				case S_IFBLK:
-					dent->d_type = DT_BLK;
-					break;
-				case S_IFCHR:
-					dent->d_type = DT_CHR;
-					break;
-				case S_IFIFO:
-					dent->d_type = DT_FIFO;
-					break;
-				case S_IFLNK:
-					dent->d_type = DT_LNK;
-					break;
-				case S_IFSOCK:
-					dent->d_type = DT_SOCK;
-					break;
-			}
-		} else {
-#     		      if defined(PR_ATOMIC_ADD)
-        		PR_ATOMIC_ADD(&statcount, 1);
-#     		      else
-        		pthread_mutex_lock(&statcount_lock);
-			statcount++;
-        		pthread_mutex_unlock(&statcount_lock);
-#     		      endif
-		}
+	copy = strdup(rule);
+	assert(copy);
+	if (! strchr(copy, '/')) {
+		exclude_names = realloc(exclude_names, (exclude_names_count + 1) * sizeof(*exclude_names));
+		assert(exclude_names);
+		exclude_names[exclude_names_count++] = copy;
+		return;
 	}
 
-	if (dent->d_type == DT_DIR) {
-		dive_into_subdir = TRUE;
+	// - Paths are built while walking with a single / between the components, and the start point as given.
+	for (p = q = copy; *p; p++)
+		if (*p != '/' || q == copy || q[-1] != '/')
+			*q++ = *p;
+	if (q > copy + 1 && q[-1] == '/')
+		q--;
+	*q = '\0';
+	exclude_paths = realloc(exclude_paths, (exclude_paths_count + 1) * sizeof(*exclude_paths));
+	assert(exclude_paths);
+	exclude_paths[exclude_paths_count++] = copy;
+}
 
-		if (xdev && curdir->st_dev != st.st_dev)
-			dive_into_subdir = FALSE;
+/////////////////////////////////////////////////////////////////////////////
+
+// Add a regular expression for directories to skip (-e). Returns FALSE if it doesn't compile.
+static boolean exclude_add_pattern(
+	const char *pattern)
+{
+	exclude_patterns = realloc(exclude_patterns, (exclude_patterns_count + 1) * sizeof(*exclude_patterns));
+	assert(exclude_patterns);
+	exclude_recomps = realloc(exclude_recomps, (exclude_patterns_count + 1) * sizeof(*exclude_recomps));
+	assert(exclude_recomps);
+	exclude_patterns[exclude_patterns_count] = strdup(pattern);
+	assert(exclude_patterns[exclude_patterns_count]);
+	if (! regex_init(&exclude_recomps[exclude_patterns_count], exclude_patterns[exclude_patterns_count], REG_EXTENDED|REG_NOSUB)) {
+		free(exclude_recomps[exclude_patterns_count]);
+		free(exclude_patterns[exclude_patterns_count]);
+		return FALSE;
 	}
-#else // - non-Linux/BSD goes here: // - non-Linux/BSD goes here:
-        if (curdir->st_nlink > 2) {
-#             if defined(PR_ATOMIC_ADD)
-                PR_ATOMIC_ADD(&statcount, 1);
-#             else
-                pthread_mutex_lock(&statcount_lock);
-                statcount++;
-                pthread_mutex_unlock(&statcount_lock);
-#             endif
+	exclude_patterns_count++;
+	return TRUE;
+}
 
-		rc = lstat(path, &st);
-		if (rc && errno == EACCES) {
-			pthread_mutex_lock(&perror_lock);
-			perror(path);
-			pthread_mutex_unlock(&perror_lock);
-		}
+/////////////////////////////////////////////////////////////////////////////
 
-		if (S_ISDIR(st.st_mode)) {
-			dive_into_subdir = TRUE;
+// Load the exclusion rules of option --exclude-from, one per line:
+// "-e <regex>", "-E <name or path>", or just the name or path. Empty lines and lines starting with # are skipped.
+static void exclude_load(
+	const char *file)
+{
+	char line[PATH_MAX + 8];
+	unsigned lineno = 0;
+	size_t len;
+	FILE *fp;
 
-			if (xdev && curdir->st_dev != st.st_dev)
-				dive_into_subdir = FALSE;
+	if (! (fp = fopen(file, "r"))) {
+		fprintf(stderr, "%s: ", progname);
+		perror(file);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		else if (! feof(fp)) {
+			fprintf(stderr, "%s: %s:%u: Line too long - bailing out.\n", progname, file, lineno);
+			exit(1);
 		}
+		if (len && line[len - 1] == '\r')
+			line[--len] = '\0';
+		if (! len || *line == '#')
+			continue;
+
+		if (strncmp(line, "-e ", 3) == 0) {
+			if (! exclude_add_pattern(line + 3)) {
+				fprintf(stderr, "%s: %s:%u: Bad regular expression - bailing out.\n", progname, file, lineno);
+				exit(1);
+			}
+		} else
+			exclude_add(strncmp(line, "-E ", 3) == 0 ? line + 3 : line);
 	}
-#endif
+	fclose(fp);
+}
 
-	if (dive_into_subdir) {
-		if (maxdepth) {
-			if (curdir->depth >= maxdepth) {
-				free(path);
-				return;
+/////////////////////////////////////////////////////////////////////////////
+
+// Order paths component by component, i.e. as if / sorts before any other character.
+static int exclude_path_cmp(
+	const void *a,
+	const void *b)
+{
+	const unsigned char *p = *(const unsigned char **)a, *q = *(const unsigned char **)b;
+
+	for (; *p && *p == *q; p++, q++)
+		;
+	return (*p == '/' ? 1 : *p ? *p + 2 : 0) - (*q == '/' ? 1 : *q ? *q + 2 : 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Add a path to the trie. The paths are added in the order of exclude_path_cmp(), so the children of a node come in
+// order of their names, and a component is either the same as the last child of its parent, or a new last child.
+static void exclude_trie_add(
+	const char *path)
+{
+	exclude_node_t *node = &exclude_trie, *child;
+	const char *end;
+	unsigned len;
+
+	for (;;) {
+		len = (end = strchr(path, '/')) ? (unsigned)(end - path) : strlen(path);
+		child = node->child_count ? &node->children[node->child_count - 1] : NULL;
+		if (! child || child->name_len != len || memcmp(child->name, path, len)) {
+			if (! (node->child_count & (node->child_count - 1))) { // - doubled at 1, 2, 4, ... children
+				node->children = realloc(node->children, (node->child_count ? 2 * node->child_count : 1) * sizeof(*node->children));
+				assert(node->children);
 			}
+			child = &node->children[node->child_count++];
+			child->name = path;
+			child->name_len = len;
+			child->excluded = FALSE;
+			child->children = NULL;
+			child->child_count = 0;
 		}
-		if (excludelist_count > 0) {
-                	for (i = 0; i < excludelist_count; i++)
-                        	if (excluderecomp) {
-                                	if (regexec(excluderecomp[i], dent->d_name, 0, NULL, 0) == 0) {
-                                        	if (debug) fprintf(stderr, "==> Skipping dir %s (%s)\n", path, excludelist[i]);
-                                        	return;         // - skip directories specified through -e
-                                	}
-                        	} else {
-                                	if (strcmp(excludelist[i], dent->d_name) == 0) {
-                                        	if (debug) fprintf(stderr, "==> Skipping dir %s (%s)\n", path, excludelist[i]);
-                                        	return;         // - skip directories specified through -E
-                                	}
-                        	}
-        	}
-
-		if (dryrun
-		    && (! filetypemask || (filetypemask & FILETYPE_DIR)))
-			puts(path);
-
-               if (inline_processing_threshold &&
-                    (curdir->st_nlink < inline_processing_threshold + 2 ||                              // - posix compliant
-                    (simulate_posix_compliance && curdir->inlined < inline_processing_threshold))) {    // - non-compliant (btrfs)
-                        // Process up to n subdirs inline, n = inline_processing_threshold.
-			curdir->inlined++;
-
-			dirlist_t subdirentry;
-
-			subdirentry.dirpath = strdup(path);
-			assert(subdirentry.dirpath);
-			subdirentry.depth = curdir->depth+1;
-			subdirentry.inlined = 0;
-			subdirentry.st_nlink = simulate_posix_compliance ? DIRTY_CONSTANT : st.st_nlink;
-			subdirentry.st_dev = st.st_dev;
-			subdirentry.st_uid = st.st_uid;
-			subdirentry.st_gid = st.st_gid;
-			subdirentry.filecnt = 0;
-
-			walk_dir(&subdirentry);
-		} else {
-                        // - The first n subdirs, n <= inline_processing_threshold, will be enqueued and processed when a thread is available.
-                        dirlist_add_dir(path, curdir->depth+1, &st);
+		if (child->excluded) // - below a directory which is skipped already
+			return;
+		if (! end) {
+			child->excluded = TRUE;
+			return;
 		}
-	} else if (! filetypemask || (filetypemask&FILETYPE_REGFILE)) {
-                if (dryrun) {
-                        puts(path);
-                } else {
-			// - If we don't have an lstat() filled st struct so far, just set the new user/group instead of the more time consuming procedure of running lstat() and check old values.
-			if ((st.st_uid >= 0 && st.st_uid != new_uid) || (st.st_gid >= 0 && st.st_gid != new_gid))
-				do_chown(path, new_uid, new_gid);
+		node = child;
+		path = end + 1;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Compile all exclusion rules, once they are given.
+static void exclude_build()
+{
+	unsigned i, j, size;
+	size_t len = 0;
+	char *combined, *p;
+	boolean combine = exclude_patterns_count > 1;
+
+	if (exclude_names_count) {
+		for (size = 16; size < 2 * exclude_names_count; size *= 2)
+			;
+		exclude_name_set = calloc(size, sizeof(*exclude_name_set));
+		assert(exclude_name_set);
+		exclude_name_mask = size - 1;
+		for (i = 0; i < exclude_names_count; i++) {
+			for (j = str_hash(exclude_names[i]) & exclude_name_mask; exclude_name_set[j]; j = (j + 1) & exclude_name_mask)
+				;
+			exclude_name_set[j] = i + 1;
+		}
+	}
+
+	// - The patterns are combined into (p1)|(p2)|..., unless one has a back-reference, which would then refer to another group.
+	for (i = 0; i < exclude_patterns_count; i++) {
+		len += strlen(exclude_patterns[i]) + 3;
+		for (p = exclude_patterns[i]; *p; p++)
+			if (*p == '\\' && p[1] && *++p >= '1' && *p <= '9')
+				combine = FALSE;
+	}
+	if (combine) {
+		combined = p = malloc(len);
+		assert(combined);
+		for (i = 0; i < exclude_patterns_count; i++)
+			p += sprintf(p, i ? "|(%s)" : "(%s)", exclude_patterns[i]);
+		exclude_regex = malloc(sizeof(*exclude_regex));
+		assert(exclude_regex);
+		if (regcomp(exclude_regex, combined, REG_EXTENDED|REG_NOSUB)) {
+			free(exclude_regex);
+			exclude_regex = NULL;
 		}
+		free(combined);
 	}
 
-	free(path);
+	if (exclude_paths_count) {
+		qsort(exclude_paths, exclude_paths_count, sizeof(*exclude_paths), exclude_path_cmp);
+		for (i = 0; i < exclude_paths_count; i++)
+			exclude_trie_add(exclude_paths[i]);
+	}
 
-	return;
+	excluding = exclude_names_count || exclude_patterns_count || exclude_paths_count;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -541,26 +3984,41 @@ static int usage(
 	if (progname) progname++; // - move pointer past the found '/'
 	else progname = argv[0];
 
-        printf("Usage: %s [-t <count>] [-I <count>] [-e <dir> ... | -E <dir> ... | -Z] [-x] [-m <maxdepth>]\n", progname);
-	printf("\t\t [-f] [-d] [-n] [-I <count>] [-q | -Q] [-X] [-T] [-S] [-V] [user][:group] arg1 [arg2 ...]\n");
+        printf("Usage: %s [-t <count> | -t auto] [-I <count>] [-e <dir> ...] [-E <dir> ...] [-Z] [--exclude-from <file>]\n", progname);
+	printf("\t\t [-x] [-m <maxdepth>]");
+	printf(" [-f] [-d] [-n] [-u] [-l [--hardlink-memory <MB>]]\n");
+	printf("\t\t [-I <count>] [--max-queued <count>] [-B <count>] [-A] [-X]\n");
+	printf("\t\t [-q | -Q | -P [--depth-weight <count>] | -W | --dev-threads <count>]\n");
+	printf("\t\t [-O] [--io-uring <count>] [--chown-threads <count>]\n");
+	printf("\t\t [-C <file> [--checkpoint-interval <seconds>] | -R <file>] [-D <deadline>] [-s <time> | -s <stampfile>]\n");
+	printf("\t\t [-b <ops> | -b <file> [--idle-io]] [-v <count>] [-T] [-S] [-V] {[user][:group] | -M <mapfile>} arg1 [arg2 ...]\n");
         printf("-t <count>\t Run up to <count> threads in parallel.\n");
-        printf("\t\t * Must be a non-negative integer between 1 and %i.\n", MAX_THREADS);
+        printf("\t\t * Must be a non-negative integer between 1 and %i, or \"auto\".\n", MAX_THREADS);
         printf("\t\t * Defaults to (virtual) CPU count on host, up to 8.\n");
+        printf("\t\t * With \"auto\", a pool of %i threads is created, starting with the default number of active threads.\n", MAX_THREADS);
+        printf("\t\t   The number is tuned while running, to get the most entries per second without making\n");
+        printf("\t\t   the lstat/chown/getdents calls much slower. Meant for NFS and other file servers.\n");
         printf("\t\t * Note that <count> threads will be created in addition to the main thread,\n");
         printf("\t\t   so the total thread count will be <count+1>, but the main, controlling thread will be mostly idle.\n\n");
 
         printf("-e <dir>\t Exclude directory matching <dir> from traversal.\n");
         printf("\t\t * Extended regular expressions are supported.\n");
-        printf("\t\t * Any number of -e options are supported, up to command line limit.\n\n");
+        printf("\t\t * Any number of -e options are supported, up to command line limit.\n");
+        printf("\t\t * All of them are combined into a single expression, so each name is matched in one pass.\n\n");
 
 	printf("-E <dir>\t Exclude directory <dir> from traversal.\n");
         printf("\t\t * For simplicity, only exact matches are excluded.\n");
-        printf("\t\t * Any number of -E options are supported, up to command line limit.\n");
+        printf("\t\t * With a /, <dir> is the full path of a directory, starting with a start point as given.\n");
+        printf("\t\t * Any number of -E options are supported, up to command line limit, and they may be combined with -e.\n");
         printf("\t\t * Hint: Excluding .snapshot is usually desired on (the root of) NFS shares from NAS.\n\n");
 
         printf("-Z\t\t Equivalent to -E.snapshot.\n");
         printf("\t\t * Just to save some typing since it is commonly needed on a NAS NFS share.\n\n");
 
+	printf("--exclude-from <file>\n\t\t Load exclusion rules from <file>, one per line: \"-e <regex>\", \"-E <dir>\", or just <dir> as for -E.\n");
+	printf("\t\t * Empty lines and lines starting with # are skipped.\n");
+	printf("\t\t * Names are looked up in a hash set, and full paths in a trie, so thousands of rules cost little.\n\n");
+
         printf("-x\t\t Only traverse the file system(s) containing the directory/directories specified.\n");
         printf("\t\t * This equals the -xdev option to find(1).\n\n");
 
@@ -575,34 +4033,142 @@ static int usage(
 	printf("-n\t\t Can be used to dry-run before actually chown()'ing anything.\n");
 	printf("\t\t * Files and directories will just be listed on stdout, and WILL NOT be chown()'ed.\n\n");
 
+	printf("-u\t\t Only chown() entries whose user/group actually differs from the requested one.\n");
+	printf("\t\t * Just the ownership is fetched for each file, using statx() with a minimal mask where available.\n");
+	printf("\t\t * Avoids dirtying inodes and updating ctime when re-running on a tree that is mostly correct already.\n");
+	printf("\t\t * Combined with -n, only entries that would actually be changed are listed.\n\n");
+
+	printf("-l\t\t Change a file with more than one (hard) link only through the first link found, and skip the others.\n");
+	printf("\t\t * The link count, inode and ownership are fetched for each file, using statx() with a minimal mask where available.\n");
+	printf("\t\t * The files found are recorded in a hash set, split in %u stripes with a lock each, and dropped once all links are seen.\n",
+		1 << HARDLINK_STRIPE_BITS);
+	printf("\t\t * Combined with -n, only the first link found is listed.\n\n");
+
+	printf("--hardlink-memory <MB>\n\t\t Bound the memory used by the hash set of option -l.\n");
+	printf("\t\t * Once a stripe is full, files with more links are not recorded anymore, and thus changed through every link.\n");
+	printf("\t\t * Default is no limit.\n\n");
+
         printf("-I <count>\t Use <count> as number of subdirectories in a directory, that should\n");
         printf("\t\t be processed in-line instead of processing them in separate threads.\n");
         printf("\t\t * Default is to process the first two subdirectories in a directory in-line.\n");
         printf("\t\t * This is a performance option to possibly squeeze out even faster run-times.\n");
         printf("\t\t * Use 0 for no in-line processing.\n");
-        printf("\t\t * Only meaningful for POSIX compliant file systems, where directory link count is 2 plus number of subdirs.\n\n");
+        printf("\t\t * Only meaningful for POSIX compliant file systems, where directory link count is 2 plus number of subdirs.\n");
+        printf("\t\t * All subdirs are processed in-line while the queue holds more than %u directories per thread,\n", INLINE_PLENTY_PER_THREAD);
+        printf("\t\t   and all are queued while any thread is idle.\n\n");
+
+        printf("--max-queued <count>\n");
+        printf("\t\t Process every subdirectory in-line once <count> directories are queued or being processed.\n");
+        printf("\t\t * Bounds the memory used by the queue, whatever the shape of the tree.\n\n");
+        printf("-B <count>\t Split directories with more than <count> entries, and let the other threads handle\n");
+        printf("\t\t each following batch of <count> entries, while the directory is still being read.\n");
+        printf("\t\t * Default is %u. Use 0 to always process a directory in one thread.\n", DEFAULT_BATCH_THRESHOLD);
+        printf("\t\t * The directory itself is chown()'ed when all its batches have been processed.\n");
+        printf("\t\t * Keeps all threads busy on directories containing millions of files.\n\n");
 
 	printf("-q\t\t Organize the queue of directories as a FIFO which may be faster in some cases (default is LIFO).\n");
         printf("\t\t * The speed difference between a LIFO and a FIFO queue is usually small.\n");
         printf("\t\t * Note that this option will make '%s' use more memory.\n\n", progname);
 
-        printf("-Q\t\t Organize the queue of directories as a list sorted on inode number.\n");
+        printf("-Q\t\t Organize the queue of directories as a heap ordered on inode number, so the lowest inode is processed first.\n");
         printf("\t\t * Using this option with a file system on a single (or mirrored) spinning disk is recommended.\n");
         printf("\t\t * Using it on a storage array or on SSD or FLASH disk is probably pointless.\n\n");
 
+        printf("-P\t\t Organize the queue of directories as a heap ordered on the number of subdirectories, so the directory\n");
+        printf("\t\t with the most subdirectories is processed first, and big subtrees are spread over all threads early on.\n");
+        printf("\t\t * The number of subdirectories is taken from the link count, so it is only known on POSIX compliant file systems.\n");
+        printf("\t\t * Use --depth-weight=<count> to let each level of depth count as <count> subdirectories less (default is 0).\n");
+        printf("\t\t * Option -S shows how much of the time the threads were idle at the end of the run, to compare with -q/-Q/-W.\n\n");
+
+        printf("-W\t\t Give each thread its own queue of directories, and let idle threads steal work from the others.\n");
+        printf("\t\t * Each thread processes its own queue as a LIFO, while the oldest directories are stolen first.\n");
+        printf("\t\t * Avoids contention on the single, shared queue when running many threads.\n\n");
+
+        printf("--dev-threads <count>\n");
+        printf("\t\t Give each file system its own queue of directories, and let at most <count> threads work on each at a time.\n");
+        printf("\t\t * Keeps a slow mount (e.g. a hanging NFS server) from tying up all threads while other file systems wait.\n");
+        printf("\t\t * Threads are only lent to a file system beyond <count> when no other file system has any work left.\n");
+        printf("\t\t * Mount points are never processed in-line, and each queue is processed as a LIFO.\n\n");
+
+        printf("-O\t\t Handle the entries of each directory in inode order, rather than in the order they are read.\n");
+        printf("\t\t * Up to %u entries at a time are buffered and radix sorted on inode number, to bound the memory used on huge directories.\n", INODE_ORDER_CHUNK);
+        printf("\t\t * Cuts down on seeks across the inode table on a single (or mirrored) spinning disk, like -Q does for the directories.\n");
+        printf("\t\t * Using it on a storage array or on SSD or FLASH disk is probably pointless.\n\n");
+
+#if defined(AT_SYMLINK_NOFOLLOW)
+        printf("-A\t\t Handle directory entries relative to an open directory, using openat(), fstatat() and fchownat().\n");
+        printf("\t\t * Avoids that the kernel has to look up every component of the full path for each entry.\n");
+        printf("\t\t * Full paths are then only built for directories, messages and option -n.\n\n");
+#endif
+
+#if defined(HAVE_IO_URING)
+        printf("--io-uring <count>\n");
+        printf("\t\t Let each thread keep up to <count> entries stat'ed ahead through io_uring, rather than one lstat() at a time.\n");
+        printf("\t\t * With -A, subdirectories to be processed in-line are opened ahead as well.\n");
+        printf("\t\t * Meant for NFS and cold caches, where each call is a round-trip. A count of 16 - 64 is a good start.\n");
+        printf("\t\t * If the kernel doesn't support io_uring with statx and openat (Linux 5.6), the usual calls are used.\n\n");
+#endif
+
+        printf("--chown-threads <count>\n");
+        printf("\t\t Let a separate pool of <count> threads do the chown() calls, while the -t threads just read the directories.\n");
+        printf("\t\t * The entries are handed over in batches, through a ring per reading thread, which holds up to %u batches.\n", CHOWN_RING_SIZE);
+        printf("\t\t * Keeps the reading going on e.g. NFS, where a chown() is much slower than reading the directory.\n");
+        printf("\t\t * Directories are still chown()'ed by the reading threads. Option -S shows the throughput of each stage.\n\n");
+
 #if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
         printf("-X\t\t May be used to speed up %s'ing eXtremely big directories containing millions of files.\n", progname);
+        printf("\t\t * Directories are read with getdents directly into a buffer per thread, which is reused, and sized after the directory.\n");
+#if defined(__linux__)
+        printf("\t\t * This is the default on Linux, where getdents64 is used.\n");
+#endif
         printf("\t\t * Default maximum number of dirents read in one go is 100000.\n");
-        printf("\t\t * Environment variable DIRENTS may be set to override the default.\n\n");
+        printf("\t\t * Environment variable DIRENTS may be set to override the default, DIRENTS=0 selects readdir(3) instead.\n\n");
 #endif
 
+        printf("-C <file>\t Save what is left to process in checkpoint <file> when stopped by SIGINT, SIGTERM or -D.\n");
+        printf("\t\t * The checkpoint is also saved every %u seconds while running, so it survives a crash.\n", DEFAULT_CHECKPOINT_INTERVAL);
+        printf("\t\t * --checkpoint-interval <seconds> may be used to change that, 0 to only save it when stopped.\n");
+        printf("\t\t * The checkpoint file is removed when the run completes.\n");
+        printf("\t\t * Long option: --checkpoint=<file>\n\n");
+        printf("-R <file>\t Resume from checkpoint <file>, saved by an earlier run with -C or -R.\n");
+        printf("\t\t * Implies -C <file>, so the run can be stopped and resumed again.\n");
+        printf("\t\t * The same user/group must be given. If <file> does not exist, the start point(s) are processed from scratch.\n");
+        printf("\t\t * Partly processed directories are continued where they were left, when read with getdents64 on Linux.\n");
+        printf("\t\t * Long option: --resume=<file>\n\n");
+        printf("-D <deadline>\t Stop and save the checkpoint at <deadline>, given as HH:MM or as a number of seconds from now.\n");
+        printf("\t\t * Requires -C or -R. Exit status is 2 when stopped before completion.\n");
+        printf("\t\t * Long option: --deadline=<deadline>\n\n");
+
+        printf("-s <stampfile>\t Incremental mode: directories not changed since <stampfile> was written are not examined entry by entry.\n");
+        printf("\t\t * An unchanged directory is just searched for subdirectories, and not read at all if it has none.\n");
+        printf("\t\t * A directory counts as changed if its mtime or ctime is not older than the time of the stamp.\n");
+        printf("\t\t * <stampfile> is written when the run completes, with the time the run started.\n");
+        printf("\t\t * A time in seconds since the epoch may be given instead of <stampfile>.\n");
+        printf("\t\t * Files chown()'ed by others in an unchanged directory are not noticed.\n");
+        printf("\t\t * Long option: --since=<stampfile>\n\n");
+
+        printf("-M <mapfile>\t Change the ownership according to the uid/gid mappings in <mapfile>, instead of to one user/group.\n");
+        printf("\t\t * Each line is \"uid <old> <new>\", \"gid <old> <new>\", or a range \"uid <first>-<last> <new_first>\".\n");
+        printf("\t\t * Only numeric ids are supported. Lines starting with # are comments.\n");
+        printf("\t\t * The ownership of every entry is fetched, and only entries with a mapped uid or gid are chown()'ed.\n");
+        printf("\t\t * The [user][:group] argument is left out, and -S reports the number of hits for each mapping used.\n");
+        printf("\t\t * Long option: --map=<mapfile>\n\n");
+
+        printf("-b <ops>\t Run in the background, using at most <ops> lstat/chown/getdents calls per second in all, 0 for no limit.\n");
+        printf("\t\t * A <file> containing <ops> may be given instead. It is read again on SIGHUP, to change the limit while running.\n");
+        printf("\t\t * Also lowers the CPU priority (nice %d) and the I/O priority (best-effort class, lowest level).\n", BACKGROUND_NICE);
+        printf("\t\t * Use --idle-io to use the idle I/O class instead. The I/O priority has no effect on NFS.\n");
+        printf("\t\t * Long option: --background=<ops>|<file>\n\n");
+
+        printf("-v <count>\t Report the progress on stderr each time another <count> files have been processed, at most once a second.\n\n");
+
         printf("-S\t\t Print some stats to stderr when finished.\n");
         printf("-T\t\t Print the elapsed real time between invocation and termination of the program on stderr, like time(1).\n");
         printf("-V\t\t Print out version and exit.\n");
         printf("-h\t\t Print this help text.\n");
 
         printf("\n* If no argument is specified, this help text will be printed to stdout.\n");
-        printf("* User and/or group must always be specified.\n");
+        printf("* User and/or group must always be specified, unless option -M is given.\n");
         printf("  Numeric uid/gid is supported in addition to user/group name.\n");
         printf("* All arguments (arg1 arg2 ...) should be directories or symlinks to directories.\n");
         printf("  If some of them are not, they will just be excluded and an error message will be printed for each.\n");
@@ -639,11 +4205,37 @@ int main(
 	char **startdirs;
 	unsigned startdircount;
 	int ch;
+	unsigned i;
 	boolean stats = FALSE;
-	boolean e_option = FALSE, E_option = FALSE;
 	struct timeval starttime;
 	boolean timer = FALSE;
 	unsigned threads = 1;
+	char *resume_file = NULL;
+	char *since_arg = NULL;
+	stats_t sum;			// - all threads' statistics counters
+	unsigned *depths = NULL;	// - set when resuming from a checkpoint
+	sigset_t stopsigs;
+#    if defined(HAVE_GETOPT_LONG)
+	static struct option longopts[] = {
+		{"checkpoint",		required_argument, NULL, 'C'},
+		{"checkpoint-interval",	required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+		{"resume",		required_argument, NULL, 'R'},
+		{"deadline",		required_argument, NULL, 'D'},
+		{"since",		required_argument, NULL, 's'},
+		{"map",			required_argument, NULL, 'M'},
+		{"depth-weight",	required_argument, NULL, OPT_DEPTH_WEIGHT},
+		{"background",		required_argument, NULL, 'b'},
+		{"idle-io",		no_argument,	   NULL, OPT_IDLE_IO},
+		{"dev-threads",		required_argument, NULL, OPT_DEV_THREADS},
+		{"max-queued",		required_argument, NULL, OPT_MAX_QUEUED},
+		{"chown-threads",	required_argument, NULL, OPT_CHOWN_THREADS},
+		{"io-uring",		required_argument, NULL, OPT_IO_URING},
+		{"hardlinks",		no_argument,	   NULL, 'l'},
+		{"hardlink-memory",	required_argument, NULL, OPT_HARDLINK_MEMORY},
+		{"exclude-from",	required_argument, NULL, OPT_EXCLUDE_FROM},
+		{NULL,			0,		   NULL, 0}
+	};
+#    endif
 #    if defined(__hpux)
 	struct pst_dynamic psd;
 
@@ -669,44 +4261,61 @@ int main(
 
 	tzset(); // - core dumps on Ubuntu 16.04.6 LTS with kernel 4.4.0-174-generic when executed through localtime() at the end of main()
 
-	while ((ch = getopt(argc, argv, "ht:I:e:E:Zfdm:nvxqQSTVX")) != -1)
+#     if defined(HAVE_GETOPT_LONG)
+	while ((ch = getopt_long(argc, argv, OPTSTRING, longopts, NULL)) != -1)
+#     else
+	while ((ch = getopt(argc, argv, OPTSTRING)) != -1)
+#     endif
 		switch (ch) {
 			case 't':
+				if (strcmp(optarg, "auto") == 0) {
+					auto_threads = TRUE; // - starting with the default number of threads
+					break;
+				}
 				threads = atoi(optarg);
 				if (threads < 1 || threads > MAX_THREADS)
 					return usage(argv);
+				auto_threads = FALSE;
 				break;
 			case 'I':
 				inline_processing_threshold = atoi(optarg);
 				break;
+			case OPT_MAX_QUEUED:
+				if (atoi(optarg) < 1)
+					return usage(argv);
+				max_queued = atoi(optarg);
+				break;
+			case OPT_IO_URING:
+				if (atoi(optarg) < 1 || atoi(optarg) > 1024)
+					return usage(argv);
+#			      if defined(HAVE_IO_URING)
+				uring_depth = atoi(optarg);
+#			      else
+				fprintf(stderr, "Option --io-uring is not implemented for this OS, ignored.\n");
+#			      endif
+				break;
+			case OPT_CHOWN_THREADS:
+				if (atoi(optarg) < 1 || atoi(optarg) > MAX_THREADS)
+					return usage(argv);
+				chown_threads = atoi(optarg);
+				break;
+			case 'B':
+				if (! isdigit((int)*optarg))
+					return usage(argv);
+				batch_threshold = atoi(optarg);
+				break;
 			case 'e':
-				if (E_option) {
-					fprintf(stderr, "Option -e can not be combined with -E.\n");
-					exit(1);
-				}
-				excludelist = realloc(excludelist, (excludelist_count + 1) * sizeof(excludelist));
-				assert(excludelist);
-				excludelist[excludelist_count] = optarg;
-				excluderecomp = realloc(excluderecomp, (excludelist_count + 1) * sizeof(excluderecomp));
-				assert(excluderecomp);
-				if (! regex_init(&excluderecomp[excludelist_count], optarg, REG_EXTENDED|REG_NOSUB))
+				if (! exclude_add_pattern(optarg))
 					return usage(argv);
-				excludelist_count++;
-				e_option = TRUE;
 				break;
 			case 'E':
+				exclude_add(optarg);
+				break;
                         case 'Z':
-				if (e_option) {
-					fprintf(stderr, "Option -E  / -Z can not be combined with -e.\n");
-					exit(1);
-				}
-				excludelist = realloc(excludelist, (excludelist_count + 1) * sizeof(excludelist));
-				assert(excludelist);
-                                if (ch == 'E')
-                                        excludelist[excludelist_count++] = optarg;
-                                else
-                                        excludelist[excludelist_count++] = ".snapshot";
-				E_option = TRUE;
+				exclude_add(".snapshot");
+				break;
+			case OPT_EXCLUDE_FROM:
+				exclude_load(optarg);
 				break;
        		        case 'f':
 	                        filetypemask |= FILETYPE_REGFILE;
@@ -722,6 +4331,21 @@ int main(
 			case 'n':
 				dryrun = TRUE;
 				break;
+			case 'u':
+				skip_unchanged = TRUE;
+				break;
+			case 'l':
+				hardlinks = TRUE;
+				break;
+			case OPT_HARDLINK_MEMORY:
+				if (atoi(optarg) < 1)
+					return usage(argv);
+				// - Megabytes for the whole set, as a power of two number of slots per stripe.
+				for (hardlink_max_slots = 1;
+				     hardlink_max_slots * 2 <= ((unsigned long long)atoi(optarg) << 20) / sizeof(hardlink_t) >> HARDLINK_STRIPE_BITS;
+				     hardlink_max_slots *= 2)
+					;
+				break;
 			case 'v':
 				if (atoi(optarg) < 1)
 					return usage(argv);
@@ -733,12 +4357,91 @@ int main(
 			case 'q':
 				fifo_queue = TRUE;
                         	lifo_queue = FALSE;
-                        	ino_queue = FALSE;
+                        	heap_queue = FALSE;
+                        	prio_queue = FALSE;
+                        	ws_queue = FALSE;
+                        	dev_threads = 0;
 				break;
 			case 'Q':
-                        	ino_queue = TRUE;
+                        	heap_queue = TRUE;
+                        	prio_queue = FALSE;
+                        	lifo_queue = FALSE;
+                        	fifo_queue = FALSE;
+                        	ws_queue = FALSE;
+                        	dev_threads = 0;
+				break;
+			case 'O':
+				inode_order = TRUE;
+				break;
+			case 'P':
+                        	heap_queue = TRUE;
+                        	prio_queue = TRUE;
+                        	lifo_queue = FALSE;
+                        	fifo_queue = FALSE;
+                        	ws_queue = FALSE;
+                        	dev_threads = 0;
+				break;
+			case 'b':
+				background = TRUE;
+				if (*optarg && strspn(optarg, "0123456789") == strlen(optarg))
+					rate_set(atoi(optarg));
+				else
+					rate_file = optarg;
+				break;
+			case OPT_IDLE_IO:
+				idle_io = TRUE;
+				break;
+			case OPT_DEPTH_WEIGHT:
+				if (! isdigit((int)*optarg))
+					return usage(argv);
+				depth_weight = atoi(optarg);
+				break;
+			case 'W':
+                        	ws_queue = TRUE;
                         	lifo_queue = FALSE;
                         	fifo_queue = FALSE;
+                        	heap_queue = FALSE;
+                        	prio_queue = FALSE;
+                        	dev_threads = 0;
+				break;
+			case OPT_DEV_THREADS:
+				if (atoi(optarg) < 1)
+					return usage(argv);
+				dev_threads = atoi(optarg);
+                        	lifo_queue = FALSE;
+                        	fifo_queue = FALSE;
+                        	heap_queue = FALSE;
+                        	prio_queue = FALSE;
+                        	ws_queue = FALSE;
+				break;
+			case 'A':
+#			      if defined(AT_SYMLINK_NOFOLLOW)
+				at_calls = TRUE;
+#			      else
+				fprintf(stderr, "Option -A is not implemented for this OS.\n");
+				exit(1);
+#			      endif
+				break;
+			case 'C':
+				checkpoint_file = optarg;
+				break;
+			case OPT_CHECKPOINT_INTERVAL:
+				if (! isdigit((int)*optarg))
+					return usage(argv);
+				checkpoint_interval = atoi(optarg);
+				break;
+			case 'R':
+				resume_file = optarg;
+				break;
+			case 'D':
+				if (! (deadline = parse_deadline(optarg)))
+					return usage(argv);
+				break;
+			case 's':
+				since_arg = optarg;
+				break;
+			case 'M':
+				map_file = optarg;
 				break;
 			case 'S':
 				stats = TRUE;
@@ -754,10 +4457,6 @@ int main(
 			case 'X':
 #			      if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 				extreme_readdir = TRUE;
-				if (getenv("DIRENTS"))
-					buf_size = atoi(getenv("DIRENTS")) * sizeof(struct dirent);
-				else
-					buf_size = DEFAULT_DIRENT_COUNT * sizeof(struct dirent);
 #			      else
 				fprintf(stderr, "Option -X is not implemented for this OS.\n");
 				exit(1);
@@ -772,9 +4471,47 @@ int main(
 	argc -= optind;
 	argv += optind;
 
+	if (resume_file && ! checkpoint_file)
+		checkpoint_file = resume_file; // - keep the checkpoint up to date while resuming
+	if (dryrun)
+		chown_threads = 0; // - nothing to chown
+	entbuf_used = inode_order || uring_depth;
+	if (! inode_order)
+		entbuf_chunk = PREFETCH_CHUNK;
+	if (deadline && ! checkpoint_file) {
+		fprintf(stderr, "Option -D requires -C or -R.\n");
+		exit(1);
+	}
+	if (idle_io && ! background) {
+		fprintf(stderr, "Option --idle-io requires -b.\n");
+		exit(1);
+	}
+	if (hardlink_max_slots && ! hardlinks) {
+		fprintf(stderr, "Option --hardlink-memory requires -l.\n");
+		exit(1);
+	}
+	exclude_build();
+	if (hardlinks)
+		for (i = 0; i < 1 << HARDLINK_STRIPE_BITS; i++)
+			pthread_mutex_init(&hardlink_set[i].lock, NULL);
+	if (rate_file && ! rate_read())
+		exit(1);
+	if (checkpoint_file) {
+		checkpoint_tmpfile = malloc(strlen(checkpoint_file) + 5);
+		assert(checkpoint_tmpfile);
+		sprintf(checkpoint_tmpfile, "%s.tmp", checkpoint_file);
+	}
+
 	if (argc < 1) {
 		fprintf(stderr, "Too few arguments - bailing out...\n");
 		return usage(argv-optind);
+	} else if (map_file) {
+		// - The ownership map replaces the [user][:group] argument, so all arguments are start points.
+		idmap_load(map_file);
+		new_uid = -1;
+		new_gid = -1;
+		startdirs = argv;
+		startdircount = argc;
 	} else {
 		char *ugptr = *argv;
 		if (isdigit((int)*ugptr)) {
@@ -828,16 +4565,116 @@ int main(
 		startdircount = argc-1;
 	}
 
+	if (since_arg)
+		since = since_load(since_arg); // - needs new_uid/new_gid
+
+	// - The start points are replaced by what was left to process, if there is a checkpoint to resume from.
+	run_start = time(NULL);
+	if (resume_file && resume_load(resume_file, &startdirs, &startdircount, &depths)) {
+		if (! startdircount && ! resume_batch_count) {
+			fprintf(stderr, "%s: Nothing left to process in checkpoint %s.\n", progname, resume_file);
+			(void) unlink(resume_file);
+			return 0;
+		}
+		if (debug)
+			fprintf(stderr, "Resuming %u directories from %s\n", startdircount, resume_file);
+	}
+
 	if (debug && filetypemask)
 		fprintf(stderr, "Filetypemask=%i\n", filetypemask);
 
-	if (threads == 1)
+#     if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+	if (getenv("DIRENTS")) {
+		buf_size = atoi(getenv("DIRENTS")) * sizeof(struct dirent);
+		if (! buf_size)
+			extreme_readdir = FALSE; // - DIRENTS=0 selects readdir(3)
+		else if (buf_size < DENTS_MIN_SIZE)
+			buf_size = DENTS_MIN_SIZE;
+	} else
+		buf_size = DEFAULT_DIRENT_COUNT * sizeof(struct dirent);
+#     endif
+
+	if (threads == 1 && ! auto_threads) {
                 inline_processing_threshold = DIRTY_CONSTANT; // - process everything inline if we have just 1 CPU...
+		batch_threshold = 0;			      // - ...and there is nobody to share a big directory with
+	}
+
+	// - With -t auto, a pool of MAX_THREADS threads is created, and thread_tune() decides how many of them are active.
+	thread_cnt = auto_threads ? MAX_THREADS : threads;
+	active_threads = threads;
+
+	// - SIGINT/SIGTERM (and SIGHUP) should only be caught by the main thread, so they are blocked while the threads are created.
+	sigemptyset(&stopsigs);
+	sigaddset(&stopsigs, SIGINT);
+	sigaddset(&stopsigs, SIGTERM);
+	if (rate_file)
+		sigaddset(&stopsigs, SIGHUP);
+	if (checkpoint_file || rate_file)
+		pthread_sigmask(SIG_BLOCK, &stopsigs, NULL);
+
+	if (background)
+		background_priority();
 
-	thread_cnt = threads;
+	clock_gettime(CLOCK_MONOTONIC, &run_t0);
 	thread_prepare();
+	if (chown_threads)
+		chown_stage_start();
+
+	if (checkpoint_file) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = stop_handler;
+		sa.sa_flags = SA_RESETHAND; // - a second signal terminates right away
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
+	if (rate_file) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = rate_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGHUP, &sa, NULL);
+	}
+	if (checkpoint_file || rate_file)
+		pthread_sigmask(SIG_UNBLOCK, &stopsigs, NULL);
+
+	if (resume_batch_count)
+		resume_queue_batches();
 
-	traverse_trees(startdirs, startdircount);
+	traverse_trees(startdirs, startdircount, depths);
+	if (chown_threads)
+		chown_stage_finish();
+
+	if (stopping) {
+		int left = checkpoint_write();
+		if (left >= 0) {
+			if (stop_requested < 0)
+				fprintf(stderr, "%s: Deadline reached", progname);
+			else
+				fprintf(stderr, "%s: Stopped by signal %i", progname, (int)stop_requested);
+			fprintf(stderr, " - %i directories left to process are saved in %s, use -R to resume.\n", left, checkpoint_file);
+		}
+	} else if (checkpoint_file) {
+		if (unlink(checkpoint_file) < 0 && errno != ENOENT) {
+			fprintf(stderr, "%s: ", progname);
+			perror(checkpoint_file);
+		}
+	}
+
+	stats_sum(&sum);
+
+	// - Entries that could not be chown()'ed would be skipped by the next run, so the stamp file is left alone then.
+	//   So it is when only part of the tree was examined, or only some types of entries were changed.
+	if (stampfile && ! stopping && ! dryrun) {
+		if (sum.file_no_access || sum.file_any_other_error)
+			fprintf(stderr, "%s: Stamp file %s not updated because of unsuccessful chown() calls.\n", progname, stampfile);
+		else if (filetypemask || maxdepth || excluding || xdev)
+			fprintf(stderr, "%s: Stamp file %s not updated since the run was partial (-f, -d, -m, -e, -E, -Z, --exclude-from or -x).\n",
+				progname, stampfile);
+		else
+			stamp_write();
+	}
 
 	thread_cleanup();
 
@@ -854,23 +4691,133 @@ int main(
 		fprintf(stderr, "| Some final tidbits from \"-S\" |\n");
 		fprintf(stderr, "+------------------------------+\n");
 		fprintf(stderr, "- Version: %s\n", VERSION);
-		fprintf(stderr, "- Number of active threads used: %i\n", threads);
+		if (auto_threads) {
+			unsigned t, i, from, to, lo = threads, hi = threads;
+			double avg;
+			for (t = 0; t < tune_log_count; t++) {
+				if (tune_log[t] < lo)
+					lo = tune_log[t];
+				if (tune_log[t] > hi)
+					hi = tune_log[t];
+			}
+			fprintf(stderr, "- Number of active threads used: between %u and %u, tuned every %u ms (-t auto)\n", lo, hi, AUTO_TUNE_USEC / 1000);
+			if (tune_log_count >= 10) {
+				fprintf(stderr, "- Average number of active threads per tenth of the run:");
+				for (from = 0, t = 1; t <= 10; t++, from = to) {
+					to = tune_log_count * t / 10;
+					for (avg = 0, i = from; i < to; i++)
+						avg += tune_log[i];
+					fprintf(stderr, " %.1f", avg / (to - from));
+				}
+				fprintf(stderr, "\n");
+			}
+			if (sum.timed_calls)
+				fprintf(stderr, "- Average time per lstat/chown/getdents call: %.1f us\n", (double)sum.timed_nsec / sum.timed_calls / 1000);
+		} else
+			fprintf(stderr, "- Number of active threads used: %i\n", threads);
 		fprintf(stderr, "- Number of subdirectories processed in-line per directory (and not in a separate thread): %i\n", inline_processing_threshold);
+		fprintf(stderr, "- Subdirectories processed in-line: %llu, beyond -I since the queue held plenty: %llu, since --max-queued was reached: %llu\n",
+			sum.inlined_dirs, sum.inlined_plenty, sum.inlined_forced);
+		fprintf(stderr, "- Subdirectories queued instead of processed in-line, since threads were idle: %llu\n", sum.queued_starving);
+		fprintf(stderr, "- Peak number of directories queued or being processed: %u\n", outstanding_peak);
+		{
+			unsigned long slab_total = 0;
+			unsigned i;
+			for (i = 0; i <= thread_cnt; i++)
+				slab_total += threadlocal_arr[i].slab_bytes;
+			fprintf(stderr, "- Memory used by queued directories and shared path prefixes (peak): %lu KB\n", slab_total / 1024);
+		}
 #if 	      defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 		if (extreme_readdir) {
-			fprintf(stderr, "- Number of SYS_getdents system calls = %u\n", getdents_calls);
+			fprintf(stderr, "- Number of getdents system calls = %llu\n", sum.getdents_calls);
 			fprintf(stderr, "- Used DIRENTS = %lu\n", (unsigned long)buf_size / sizeof(struct dirent));
 		}
 #	      endif
-		fprintf(stderr, "- Mandatory lstat calls (at least 1 per directory): %i\n", statcount);
+		fprintf(stderr, "- Mandatory lstat calls (at least 1 per directory): %llu\n", sum.statcount);
 #	      if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
-		fprintf(stderr, "- Unexpected lstat calls (when returned d_type is DT_UNKNOWN): %i\n", statcount_unexp);
+		fprintf(stderr, "- Unexpected lstat calls (when returned d_type is DT_UNKNOWN): %llu\n", sum.statcount_unexp);
+		fprintf(stderr, "- lstat calls saved on DT_UNKNOWN entries, since all subdirectories were found (link count): %llu\n", sum.statcount_elided);
 #	      endif
-		fprintf(stderr, "- Number of queued directories: %i\n", queued_dirs);
-		fprintf(stderr, "- Number of files/directories chown()'ed: %i\n", entries_chowned);
-                fprintf(stderr, "- Unsuccessful chown() calls, type EACCES: %i\n", file_no_access);
-                fprintf(stderr, "- Unsuccessful chown() calls, type ENOENT: %i\n", file_not_found);
-                fprintf(stderr, "- Unsuccessful chown() calls, type \"any other reason\": %i\n", file_any_other_error);
+		fprintf(stderr, "- Number of queued directories: %llu\n", sum.queued_dirs);
+		if (excluding)
+			fprintf(stderr, "- Directories skipped by exclusion rules: %llu (%u names, %u patterns%s, %u full paths)\n",
+				sum.dirs_excluded, exclude_names_count, exclude_patterns_count, exclude_regex ? " combined" : "", exclude_paths_count);
+		if (inode_order)
+			fprintf(stderr, "- Entries handled in inode order: %llu, in %llu sorted chunks\n", sum.inode_sorted, sum.inode_sorts);
+		if (uring_depth) {
+			if (uring_unavailable)
+				fprintf(stderr, "- io_uring with statx and openat is not supported here, so the usual system calls were used\n");
+			fprintf(stderr, "- Entries stat'ed ahead through io_uring: %llu, directories opened ahead: %llu (%llu of them queued after all)\n",
+				sum.uring_stats, sum.uring_opens, sum.uring_opens_unused);
+			fprintf(stderr, "- Times a thread waited for io_uring requests to complete: %llu\n", sum.uring_waits);
+		}
+		if (chown_threads) {
+			double read_sec = (double)run_end_usec / 1000000, chown_sec = (double)chown_end_usec / 1000000;
+			fprintf(stderr, "- Reading stage: %llu entries in %.2f seconds (%.0f entries/s)\n",
+				sum.entries, read_sec, read_sec > 0 ? sum.entries / read_sec : 0);
+			fprintf(stderr, "- Chown stage: %llu entries chown()'ed by %u threads in %.2f seconds (%.0f entries/s)\n",
+				sum.chown_entries, chown_threads, chown_sec, chown_sec > 0 ? sum.chown_entries / chown_sec : 0);
+			fprintf(stderr, "- Batches handed to the chown threads: %llu, waiting per hand-off: %.1f on average, %u at most (room for %u per thread)\n",
+				sum.chown_handoffs, sum.chown_handoffs ? (double)sum.chown_occupancy / sum.chown_handoffs : 0,
+				chown_pending_peak, CHOWN_RING_SIZE);
+			fprintf(stderr, "- Times a thread waited for room in its ring, since the chown threads were behind: %llu\n", sum.chown_ring_full);
+		}
+		fprintf(stderr, "- Number of times an idle thread was parked waiting for work: %llu\n", sum.parks);
+		if (background)
+			fprintf(stderr, "- Ops budget (-b): %u ops/s%s, time the threads waited for it: %.2f thread seconds\n",
+				rate_ops, rate_ops ? "" : " (no limit)", (double)sum.rate_wait_nsec / 1000000000);
+		if (run_end_usec >= 10) {
+			double tail = (double)thread_cnt * (run_end_usec / 10), idle = idle_sum(run_end_usec - run_end_usec / 10);
+			fprintf(stderr, "- Idle thread time in the last 10%% of the run: %.3f of %.3f thread seconds (%.0f%%)\n",
+				idle / 1000000, tail / 1000000, 100 * idle / tail);
+		}
+		if (ws_queue)
+			fprintf(stderr, "- Number of directories stolen from other threads' queues: %llu\n", sum.steals);
+		if (dev_threads) {
+			unsigned i;
+
+			for (i = 0; i < devqueue_cnt; i++)
+				fprintf(stderr, "- File system 0x%lx: %llu directories queued, at most %u threads busy at a time (--dev-threads %u)\n",
+					devqueues[i].st_dev, devqueues[i].dirs, devqueues[i].busy_max, dev_threads);
+		}
+		if (batch_threshold) {
+			fprintf(stderr, "- Number of directories with more than %u entries split into batches (-B): %llu\n", batch_threshold, sum.dirs_split);
+			fprintf(stderr, "- Number of batches of entries handed to other threads (-B): %llu\n", sum.batches);
+		}
+		if (checkpoint_file)
+			fprintf(stderr, "- Number of checkpoints written: %u\n", checkpoints_written);
+		if (since) {
+			fprintf(stderr, "- Number of unchanged directories just searched for subdirectories (-s): %llu\n", sum.dirs_unchanged);
+			fprintf(stderr, "- Number of unchanged directories without subdirectories, not read at all (-s): %llu\n", sum.dirs_unread);
+		}
+		fprintf(stderr, "- Number of directory entries handled: %llu\n", sum.entries);
+		fprintf(stderr, "- Number of files/directories chown()'ed: %llu\n", sum.entries_chowned);
+		if (map_file) {
+			idmap_print_stats(&uid_map, 0, "uid");
+			idmap_print_stats(&gid_map, uid_map.count, "gid");
+		}
+		if (skip_unchanged)
+			fprintf(stderr, "- Number of files/directories skipped since the ownership was already correct (-u): %llu\n", sum.entries_unchanged);
+		if (skip_unchanged || map_file || hardlinks)
+			fprintf(stderr, "- Ownership lookups for files without a known owner (-u, -M, -l): %llu\n", sum.ownerstat_calls);
+		if (hardlinks) {
+			unsigned long long slots = 0, recorded = 0;
+
+			for (i = 0; i < 1 << HARDLINK_STRIPE_BITS; i++)
+				if (hardlink_set[i].slots) {
+					slots += hardlink_set[i].mask + 1;
+					recorded += hardlink_set[i].count;
+				}
+			fprintf(stderr, "- Links skipped since the file was changed through another link (-l): %llu\n", sum.hardlinks_skipped);
+			fprintf(stderr, "- Files with more links recorded: %llu, still recorded at the end: %llu, in %llu KB\n",
+				sum.hardlinks_recorded, recorded, slots * sizeof(hardlink_t) / 1024);
+			if (hardlink_max_slots)
+				fprintf(stderr, "- Links of files not recorded, since the set was full (--hardlink-memory): %llu\n",
+					sum.hardlinks_unrecorded);
+		}
+                fprintf(stderr, "- Unsuccessful chown() calls, type EACCES: %llu\n", sum.file_no_access);
+                fprintf(stderr, "- Unsuccessful chown() calls, type ENOENT: %llu\n", sum.file_not_found);
+                fprintf(stderr, "- Unsuccessful chown() calls, type \"any other reason\": %llu\n", sum.file_any_other_error);
 
 #             if defined(PR_ATOMIC_ADD)
 		fprintf(stderr, "- Program compiled with support for __sync_add_and_fetch\n");
@@ -879,5 +4826,5 @@ int main(
                 fprintf(stderr, "- Compiled using: %s\n", CC_USED);
 #             endif
 	}
-	return 0;
+	return stopping ? 2 : 0;
 }
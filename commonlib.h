@@ -45,7 +45,8 @@ static inline __attribute__((always_inline)) void lifodirlist_insert(
 /////////////////////////////////////////////////////////////////////////////
 
 // For LIFO queue - default
-static inline __attribute__((always_inline)) dirlist_t *lifodirlist_extract()
+static inline __attribute__((always_inline)) dirlist_t *lifodirlist_extract(
+	threadlocal_t *tl)
 {
 	pthread_mutex_lock(&dirlist_lock);
         if (! dirlist_head) {
@@ -55,6 +56,7 @@ static inline __attribute__((always_inline)) dirlist_t *lifodirlist_extract()
 	dirlist_t *first = dirlist_head;
 	dirlist_head = dirlist_head->next;
 	queuesize--;
+	tl->curnode = first;
 	pthread_mutex_unlock(&dirlist_lock);
 	return first;
 }
@@ -81,7 +83,8 @@ static inline __attribute__((always_inline)) void fifodirlist_insert(
 /////////////////////////////////////////////////////////////////////////////
 
 // For FIFO queue - used if option -q is selected
-static inline __attribute__((always_inline)) dirlist_t *fifodirlist_extract()
+static inline __attribute__((always_inline)) dirlist_t *fifodirlist_extract(
+	threadlocal_t *tl)
 {
 	dirlist_t *first;
 
@@ -96,72 +99,251 @@ static inline __attribute__((always_inline)) dirlist_t *fifodirlist_extract()
 	else
 		dirlist_head = dirlist_head->next;
 	queuesize--;
+	tl->curnode = first;
 	pthread_mutex_unlock(&dirlist_lock);
 	return first;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-// For inode queue - used if option -Q is selected
-static inline __attribute__((always_inline)) void inodirlist_bintreeinsert(
+// For heap queue - used if option -P is selected
+// Directories with many subdirectories (st_nlink - 2 on POSIX file systems) are processed first, so that big
+// subtrees are spread over the threads early on. Each level of depth costs depth_weight subdirectories.
+static inline __attribute__((always_inline)) long long dirlist_priority(
+	const dirlist_t *dir)
+{
+	long long subdirs = 0;
+
+	if (dir->st_nlink > 2 && dir->st_nlink != (unsigned)DIRTY_CONSTANT)
+		subdirs = dir->st_nlink - 2;
+	return subdirs - (long long)depth_weight * dir->depth;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// For heap queue - used if option -Q or -P is selected
+// The queue is a pairing heap ordered on inode number (-Q) or priority (-P), where prev points to the first child
+// and next to the next sibling.
+// Meld two heaps, whose roots have no siblings, and return the root of the result.
+static inline __attribute__((always_inline)) dirlist_t *heapdirlist_meld(
+	dirlist_t *a,
+	dirlist_t *b)
+{
+	dirlist_t *tmp;
+
+	if (! a)
+		return b;
+	if (! b)
+		return a;
+	if (prio_queue ? dirlist_priority(b) > dirlist_priority(a) : b->st_ino < a->st_ino) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+	b->next = a->prev;
+	a->prev = b;
+	return a;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// For heap queue - used if option -Q or -P is selected
+static inline __attribute__((always_inline)) void heapdirlist_insert(
 	dirlist_t *newdir)
 {
-	dirlist_t *current;
-	dirlist_t *prev = NULL;
 	newdir->next = NULL;
 	newdir->prev = NULL;
 
 	pthread_mutex_lock(&dirlist_lock);
-	current = dirlist_head;
-	while (current) {
-		prev = current;
-		inolist_bypasscount++;
-
-		if (newdir->st_ino < current->st_ino) {
-			current = current->prev;
-		} else {
-			current = current->next;
-		}
-	}
-
-	if (! prev) {
-       		dirlist_head = newdir;
-    	} else if (newdir->st_ino < prev->st_ino) {
-       		prev->prev = newdir;
-	} else {
-		prev->next = newdir;
-	}
+	dirlist_head = heapdirlist_meld(dirlist_head, newdir);
         queuesize++;
 	pthread_mutex_unlock(&dirlist_lock);
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-// For inode queue - used if option -Q is selected
-static inline __attribute__((always_inline)) dirlist_t *inodirlist_bintreeextract()
+// For heap queue - used if option -Q or -P is selected
+// Take the directory with the lowest inode number (or highest priority), and meld its children pairwise from left to right,
+// and then the pairs from right to left, which keeps the amortized cost at O(log n).
+static inline __attribute__((always_inline)) dirlist_t *heapdirlist_extract(
+	threadlocal_t *tl)
 {
-	dirlist_t *current;
-	dirlist_t *previous = NULL;
+	dirlist_t *root, *pairs = NULL, *a, *b, *rest;
 
        	pthread_mutex_lock(&dirlist_lock);
-	current = dirlist_head;
-	if (! queuesize) {
+	if (! (root = dirlist_head)) {
        		pthread_mutex_unlock(&dirlist_lock);
 		return NULL;
 	}
-	while (current->prev) {
-		// We do have at least a child to the left
-		previous = current;
-		current = current->prev;
+
+	for (a = root->prev; a; a = rest) {
+		if ((b = a->next)) {
+			rest = b->next;
+			a->next = b->next = NULL;
+			a = heapdirlist_meld(a, b);
+		} else
+			rest = NULL;
+		a->next = pairs; // - the pairs are kept in reverse order
+		pairs = a;
+	}
+	for (dirlist_head = NULL; pairs; pairs = rest) {
+		rest = pairs->next;
+		pairs->next = NULL;
+		dirlist_head = heapdirlist_meld(dirlist_head, pairs);
 	}
-	if (previous)
-		previous->prev = current->next;
-	else
-		dirlist_head = current->next;
 
        	queuesize--;
+	tl->curnode = root;
        	pthread_mutex_unlock(&dirlist_lock);
-	return current;
+	return root;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// For work-stealing deques - used if option -W is selected
+// The owner pushes and pops at the head (LIFO), while idle threads steal the oldest entry at the tail.
+static inline __attribute__((always_inline)) void wsdirlist_insert(
+	dirlist_t *newdir)
+{
+	threadlocal_t *tl = pthread_getspecific(threadlocal_key);
+
+	if (! tl || tl->idx == thread_cnt) // - the main thread spreads the start points over all deques
+		tl = &threadlocal_arr[wsq_next_victim++ % thread_cnt];
+
+	newdir->prev = NULL;
+	pthread_mutex_lock(&tl->wsq_lock);
+	newdir->next = tl->wsq_head;
+	if (tl->wsq_head)
+		tl->wsq_head->prev = newdir;
+	else
+		tl->wsq_tail = newdir;
+	tl->wsq_head = newdir;
+	tl->wsq_size++;
+	pthread_mutex_unlock(&tl->wsq_lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// For work-stealing deques - used if option -W is selected
+static inline __attribute__((always_inline)) dirlist_t *wsdirlist_extract()
+{
+	threadlocal_t *tl = pthread_getspecific(threadlocal_key);
+	threadlocal_t *victim;
+	dirlist_t *dir;
+	unsigned i;
+
+	// Try our own deque first, newest entry:
+	if (tl->wsq_size) {
+		pthread_mutex_lock(&tl->wsq_lock);
+		if ((dir = tl->wsq_head)) {
+			tl->wsq_head = dir->next;
+			if (tl->wsq_head)
+				tl->wsq_head->prev = NULL;
+			else
+				tl->wsq_tail = NULL;
+			tl->wsq_size--;
+			tl->curnode = dir;
+			pthread_mutex_unlock(&tl->wsq_lock);
+			return dir;
+		}
+		pthread_mutex_unlock(&tl->wsq_lock);
+	}
+
+	// Then steal the oldest entry from the other threads, starting with our neighbour.
+	// One round over all the deques - if nothing is found, the caller parks until something is queued.
+	for (i = 1; i <= thread_cnt; i++) {
+		victim = &threadlocal_arr[(tl->idx + i) % thread_cnt];
+		if (! victim->wsq_size) // - unlocked peek, rechecked below
+			continue;
+		pthread_mutex_lock(&victim->wsq_lock);
+		if ((dir = victim->wsq_tail)) {
+			victim->wsq_tail = dir->prev;
+			if (victim->wsq_tail)
+				victim->wsq_tail->next = NULL;
+			else
+				victim->wsq_head = NULL;
+			victim->wsq_size--;
+			tl->curnode = dir;
+			pthread_mutex_unlock(&victim->wsq_lock);
+			if (victim != tl)
+				tl->stats.steals++;
+			return dir;
+		}
+		pthread_mutex_unlock(&victim->wsq_lock);
+	}
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// For per file system queues - used if option --dev-threads is given
+// Each file system (st_dev) gets a LIFO queue of its own, found by a linear search since there are just a few of them.
+static inline __attribute__((always_inline)) void devdirlist_insert(
+	dirlist_t *newdir)
+{
+	devqueue_t *dq;
+	unsigned i;
+
+	pthread_mutex_lock(&dirlist_lock);
+	for (i = 0; i < devqueue_cnt && devqueues[i].st_dev != newdir->st_dev; i++)
+		;
+	if (i == devqueue_cnt) {
+		if (devqueue_cnt == devqueue_size) {
+			devqueue_size = devqueue_size ? devqueue_size * 2 : 8;
+			devqueues = realloc(devqueues, devqueue_size * sizeof(*devqueues));
+			assert(devqueues);
+		}
+		memset(&devqueues[i], 0, sizeof(*devqueues));
+		devqueues[i].st_dev = newdir->st_dev;
+		devqueue_cnt++;
+	}
+	dq = &devqueues[i];
+	newdir->next = dq->head;
+	dq->head = newdir;
+	dq->size++;
+	queuesize++;
+	pthread_mutex_unlock(&dirlist_lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// For per file system queues - used if option --dev-threads is given
+// Takes a directory from the file system with the fewest threads busy on it, as long as that is below the limit.
+// A file system at its limit is only served beyond it when no other file system has anything queued or in progress,
+// so idle threads are lent to a slow mount when there is nothing else to do, but never while they are needed elsewhere.
+static inline __attribute__((always_inline)) dirlist_t *devdirlist_extract(
+	threadlocal_t *tl)
+{
+	devqueue_t *dq, *best = NULL;
+	dirlist_t *first;
+	unsigned i, active = 0;
+
+	if (! queuesize) // - unlocked peek, the caller looks again before parking
+		return NULL;
+
+	pthread_mutex_lock(&dirlist_lock);
+	for (i = 0; i < devqueue_cnt; i++) {
+		dq = &devqueues[i];
+		if (dq->size || dq->busy)
+			active++;
+		if (dq->size && (! best || dq->busy < best->busy))
+			best = dq;
+	}
+	if (! best || (best->busy >= dev_threads && active > 1)) {
+		pthread_mutex_unlock(&dirlist_lock);
+		return NULL;
+	}
+	first = best->head;
+	best->head = first->next;
+	best->size--;
+	queuesize--;
+	if (++best->busy > best->busy_max)
+		best->busy_max = best->busy;
+	best->dirs++;
+	tl->devq = best - devqueues + 1;
+	tl->curnode = first;
+	pthread_mutex_unlock(&dirlist_lock);
+	return first;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -226,18 +408,284 @@ static inline __attribute__((always_inline)) char *printable_time(
 
 /////////////////////////////////////////////////////////////////////////////
 
+// Allocate size bytes, and return the size class to free it with in *slabclass.
+// Nodes are carved out of per-thread slabs, and recycled through per-thread free lists by size class,
+// so no heap allocation is needed per queued directory.
+static inline __attribute__((always_inline)) void *slab_alloc(
+	threadlocal_t *tl,
+	size_t size,
+	unsigned char *slabclass)
+{
+	void *node;
+	unsigned class = (size + SLAB_CLASS_SIZE - 1) / SLAB_CLASS_SIZE - 1;
+
+	if (class >= SLAB_CLASSES) {
+		node = malloc(size);
+		assert(node);
+		*slabclass = SLAB_CLASSES;
+		return node;
+	}
+	if ((node = tl->slab_free[class])) {
+		tl->slab_free[class] = *(void **)node; // - the free list is linked through the first word of each node
+	} else {
+		size = (class + 1) * SLAB_CLASS_SIZE;
+		if (tl->slab_left < size) {
+			// - the remainder of the old slab, if any, is simply abandoned
+			tl->slab_cur = malloc(SLAB_SIZE);
+			assert(tl->slab_cur);
+			tl->slab_left = SLAB_SIZE;
+			tl->slab_bytes += SLAB_SIZE;
+		}
+		node = tl->slab_cur;
+		tl->slab_cur += size;
+		tl->slab_left -= size;
+	}
+	*slabclass = class;
+	return node;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Put a node on the free list of the calling thread, which need not be the one that allocated it.
+static inline __attribute__((always_inline)) void slab_free(
+	threadlocal_t *tl,
+	void *node,
+	unsigned char slabclass)
+{
+	if (slabclass == SLAB_CLASSES) {
+		free(node);
+	} else {
+		*(void **)node = tl->slab_free[slabclass];
+		tl->slab_free[slabclass] = node;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Drop a reference to a pathnode_t, and free it when nobody refers to it any more,
+// which drops its reference to the parent in turn.
+static inline __attribute__((always_inline)) void pathnode_release(
+	threadlocal_t *tl,
+	pathnode_t *pn)
+{
+	pathnode_t *parent;
+	unsigned v;
+
+	for (; pn; pn = parent) {
+#	      if defined(PR_ATOMIC_ADD)
+		v = PR_ATOMIC_ADD(&pn->refcnt, -1);
+#	      else
+		pthread_mutex_lock(&pathnode_lock);
+		v = --pn->refcnt;
+		pthread_mutex_unlock(&pathnode_lock);
+#	      endif
+		if (v)
+			return;
+		parent = pn->parent;
+		slab_free(tl, pn, pn->slabclass);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) void pathnode_retain(
+	pathnode_t *pn)
+{
+	if (! pn)
+		return;
+#     if defined(PR_ATOMIC_ADD)
+	PR_ATOMIC_ADD(&pn->refcnt, 1);
+#     else
+	pthread_mutex_lock(&pathnode_lock);
+	pn->refcnt++;
+	pthread_mutex_unlock(&pathnode_lock);
+#     endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Returns the pathnode_t of a directory being processed by this thread, to be the parent of a subdirectory to be queued.
+// It is made the first time it is needed, so a directory without queued subdirectories has none, and for a directory
+// processed in-line, so are the ones of the directories it is processed in-line from. The name is taken from the path
+// buffer, where the path of every directory the thread is processing is found, since each is a prefix of the next one.
+static pathnode_t *dir_pathnode(
+	threadlocal_t *tl,
+	dirlist_t *dir)
+{
+	pathnode_t *pn, *parent;
+	unsigned char slabclass;
+
+	if (dir->pnode)
+		return dir->pnode;
+
+	parent = dir->inline_parent ? dir_pathnode(tl, dir->inline_parent) : dir->parent;
+	pathnode_retain(parent);
+	pn = slab_alloc(tl, sizeof(pathnode_t) + dir->name_len, &slabclass);
+	pn->slabclass = slabclass;
+	pn->parent = parent;
+	pn->refcnt = 1; // - held by dir, see dirlist_free()
+	pn->len = dir->dirpath_len;
+	pn->name_len = dir->name_len;
+	memcpy(pn->name, tl->pathbuf + dir->dirpath_len - dir->name_len, dir->name_len);
+	return dir->pnode = pn;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Allocate a dirlist_t node with room for a name of length len right after it.
+static inline __attribute__((always_inline)) dirlist_t *dirlist_alloc(
+	threadlocal_t *tl,
+	size_t len)
+{
+	unsigned char slabclass;
+	dirlist_t *node = slab_alloc(tl, sizeof(dirlist_t) + len + 1, &slabclass);
+
+	node->slabclass = slabclass;
+	node->name = (char *)(node + 1);
+	node->parent = NULL;
+	node->pnode = NULL;
+	node->inline_parent = NULL;
+	node->chowns = NULL;
+	node->chowndir = NULL;
+	return node;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Free a dirlist_t node, and drop its references to its own path and its parent's.
+static inline __attribute__((always_inline)) void dirlist_free(
+	threadlocal_t *tl,
+	dirlist_t *node)
+{
+	pathnode_release(tl, node->pnode);
+	pathnode_release(tl, node->parent);
+	slab_free(tl, node, node->slabclass);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Add n to the number of outstanding directories, and return the new value.
+static inline __attribute__((always_inline)) unsigned outstanding_add(
+	int n)
+{
+	unsigned v;
+
+#     if defined(PR_ATOMIC_ADD)
+	v = PR_ATOMIC_ADD(&outstanding_dirs, n);
+#     else
+	pthread_mutex_lock(&park_lock);
+	v = outstanding_dirs += n;
+	pthread_mutex_unlock(&park_lock);
+#     endif
+#     if defined(CHOWNTREE)
+	if (v > outstanding_peak)
+		outstanding_peak = v;
+#     endif
+	return v;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Wake up (at most) n parked threads after something has been queued, or when the show is over.
+// Without any parked threads, this is just a memory barrier and a read - no system call.
+static inline __attribute__((always_inline)) void dirlist_unpark(
+	int n)
+{
+#     if defined(PR_ATOMIC_ADD)
+	__sync_synchronize(); // - pairs with the increment of parked_thread_cnt in dirlist_pull_dir()
+	if (! parked_thread_cnt)
+		return;
+#     endif
+#     if defined(USE_FUTEX)
+	PR_ATOMIC_ADD(&work_seq, 1);
+	syscall(SYS_futex, &work_seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#     else
+	pthread_mutex_lock(&park_lock);
+	if (parked_thread_cnt) {
+		work_seq++;
+		if (n == 1)
+			pthread_cond_signal(&park_cond);
+		else
+			pthread_cond_broadcast(&park_cond);
+	}
+	pthread_mutex_unlock(&park_lock);
+#     endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Keep the thread waiting as long as its index is beyond the number of active threads (option -t auto).
+static inline __attribute__((always_inline)) void thread_throttle(
+	threadlocal_t *tl)
+{
+	unsigned limit;
+
+	while (tl->idx >= (limit = active_threads) && ! master_finished && ! stopping) {
+		dirlist_unpark(1); // - in case the thread was woken up to take care of a queued directory
+#	      if defined(USE_FUTEX)
+		syscall(SYS_futex, &active_threads, FUTEX_WAIT_PRIVATE, limit, NULL, NULL, 0);
+#	      else
+		pthread_mutex_lock(&park_lock);
+		while (tl->idx >= active_threads && ! master_finished && ! stopping)
+			pthread_cond_wait(&park_cond, &park_lock);
+		pthread_mutex_unlock(&park_lock);
+#	      endif
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Put a dirlist_t node on the queue selected by -q/-Q/-W/--dev-threads, and wake up a thread to process it if any is parked.
+static inline __attribute__((always_inline)) void dirlist_enqueue(
+	dirlist_t *new_dir)
+{
+	(void) outstanding_add(1); // - before it can be pulled, processed and retired by another thread
+
+	if (lifo_queue) {
+                lifodirlist_insert(new_dir);
+        } else if (fifo_queue) {
+                fifodirlist_insert(new_dir);
+	} else if (heap_queue) {
+		heapdirlist_insert(new_dir);
+	} else if (ws_queue) {
+		wsdirlist_insert(new_dir);
+	} else if (dev_threads) {
+		devdirlist_insert(new_dir);
+        } else {
+		fprintf(stderr, "Queue type not implemented - bailing out.\n");
+		exit(1);
+	}
+
+	dirlist_unpark(1);
+
+	return;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Queue a directory, given by the path of its parent and its own name, or by its whole path if parent is NULL.
+// len is the length of the whole path.
 static inline __attribute__((always_inline)) void dirlist_add_dir(
-	const char *dirpath,
+	pathnode_t *parent,
+	const char *name,
+	unsigned len,
 	int depth,
 	struct stat *st)
 {
-	dirlist_t *new_dir = malloc(sizeof(dirlist_t));
-	assert(new_dir);
-
-	new_dir->dirpath 	= strdup(dirpath);
-	assert(new_dir->dirpath);
+	size_t name_len = strlen(name);
+	threadlocal_t *tl = pthread_getspecific(threadlocal_key);
+	dirlist_t *new_dir = dirlist_alloc(tl, name_len);
+
+	memcpy(new_dir->name, name, name_len + 1);
+	new_dir->name_len	= name_len;
+	new_dir->dirpath_len	= len;
+	new_dir->parent		= parent;
+	pathnode_retain(parent);
 	new_dir->depth   	= depth;
 	new_dir->inlined	= 0;
+#     if defined(CHOWNTREE)
+	new_dir->subdirs	= 0;
+#     endif
 	new_dir->filecnt	= 0;
 #     if defined(SRCH)
 	new_dir->du		= 0;
@@ -246,125 +694,142 @@ static inline __attribute__((always_inline)) void dirlist_add_dir(
 #     elif defined(CHOWNTREE)
         new_dir->st_uid         = st->st_uid;
         new_dir->st_gid         = st->st_gid;
+        new_dir->dirfd          = -1;
+        new_dir->batch          = NULL;
+        new_dir->unchanged      = unchanged_since(st);
 #     endif
 
 	assert(st); // st should always be filled at this point
 
-	new_dir->st_nlink = simulate_posix_compliance ? DIRTY_CONSTANT : st->st_nlink; // - simulate POSIX compliant link count for BTRFS a.o.
+	new_dir->st_nlink = st->st_nlink; // - DIRTY_CONSTANT if the file system doesn't keep POSIX link counts, see devfs_posix()
 	new_dir->st_dev = st->st_dev;
+	new_dir->st_size = st->st_size;
 #     if defined(SRCH)
 	new_dir->modtime = st->st_mtime;
 #     elif defined(CHMODTREE)
 	new_dir->st_mode = st->st_mode;
 #     endif
+	new_dir->st_ino = st->st_ino;
+
+	dirlist_enqueue(new_dir);
+	tl->stats.queued_dirs++;
+
+	return;
+}
+
+/////////////////////////////////////////////////////////////////////////////
 
+// Take the next directory from the queue selected by -q/-Q/-W/--dev-threads, or return NULL if there is nothing there.
+static inline __attribute__((always_inline)) dirlist_t *dirlist_dequeue(
+	threadlocal_t *tl)
+{
 	if (lifo_queue) {
-                lifodirlist_insert(new_dir);
-        } else if (fifo_queue) {
-                fifodirlist_insert(new_dir);
-	} else if (ino_queue) {
-		new_dir->st_ino = st->st_ino;
-		inodirlist_bintreeinsert(new_dir);
-        } else {
+		return lifodirlist_extract(tl);
+	} else if (fifo_queue) {
+		return fifodirlist_extract(tl);
+	} else if (heap_queue) {
+		return heapdirlist_extract(tl);
+	} else if (ws_queue) {
+		return wsdirlist_extract();
+	} else if (dev_threads) {
+		return devdirlist_extract(tl);
+	} else {
 		fprintf(stderr, "Queue type not implemented - bailing out.\n");
 		exit(1);
 	}
+}
 
-#if ! defined(__APPLE__)
-	if (sem_post(&threads_sem)) {
-#	      if defined(PR_ATOMIC_ADD)
-		PR_ATOMIC_ADD(&sem_val_max_exceeded_cnt, 1);
-#	      else
-		pthread_mutex_lock(&sem_val_max_exceeded_cnt_lock);
-		sem_val_max_exceeded_cnt++;
-		pthread_mutex_unlock(&sem_val_max_exceeded_cnt_lock);
-#	      endif
-	}
-#else
-        if (dispatch_semaphore_signal(threads_sem) == 0) {
-#	      if defined(PR_ATOMIC_ADD)
-		PR_ATOMIC_ADD(&sem_val_max_exceeded_cnt, 1);
-#	      else
-                pthread_mutex_lock(&sem_val_max_exceeded_cnt_lock);
-                sem_val_max_exceeded_cnt++;
-                pthread_mutex_unlock(&sem_val_max_exceeded_cnt_lock);;
-#	      endif
-        }
-#endif
+/////////////////////////////////////////////////////////////////////////////
 
+static inline __attribute__((always_inline)) void parked_add(
+	int n)
+{
 #     if defined(PR_ATOMIC_ADD)
-	PR_ATOMIC_ADD(&queued_dirs, 1);
+        PR_ATOMIC_ADD(&parked_thread_cnt, n);
 #     else
-	pthread_mutex_lock(&queued_dirs_lock);
-	queued_dirs++;
-	pthread_mutex_unlock(&queued_dirs_lock);
+	pthread_mutex_lock(&park_lock);
+	parked_thread_cnt += n;
+	pthread_mutex_unlock(&park_lock);
 #     endif
-
-	return;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline __attribute__((always_inline)) void incr_sleepers()
+// Returns the next directory to process, parking the thread while there is none.
+// Returns NULL when the show is over, or when stopping (the rest of the queue is left for the final checkpoint).
+// A thread announces itself as parked before the last look at the queue, and dirlist_enqueue() checks for parked
+// threads after queueing, so either the thread finds the new entry, or it is woken up (work_seq has moved on).
+static inline __attribute__((always_inline)) dirlist_t *dirlist_pull_dir(
+	threadlocal_t *tl)
 {
-#     if defined(PR_ATOMIC_ADD)
-        PR_ATOMIC_ADD(&sleeping_thread_cnt, 1);
-#     else
-	pthread_mutex_lock(&sleeping_thread_cnt_lock);
-	sleeping_thread_cnt++;
-	pthread_mutex_unlock(&sleeping_thread_cnt_lock);
-#     endif
+	dirlist_t *nextdir;
+	unsigned long long parked_at;
+	int seq;
+
+	while (! stopping) {
+		thread_throttle(tl);
+		if ((nextdir = dirlist_dequeue(tl)))
+			return nextdir;
+
+		parked_add(1);
+		seq = work_seq;
+		if ((nextdir = dirlist_dequeue(tl)) || master_finished || stopping) {
+			parked_add(-1);
+			return nextdir;
+		}
+		tl->stats.parks++;
+		parked_at = run_usec();
+#	      if defined(USE_FUTEX)
+		syscall(SYS_futex, &work_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0); // - returns at once if work_seq != seq
+#	      else
+		pthread_mutex_lock(&park_lock);
+		while (work_seq == seq && ! master_finished)
+			pthread_cond_wait(&park_cond, &park_lock);
+		pthread_mutex_unlock(&park_lock);
+#	      endif
+		idle_add(tl, parked_at, run_usec());
+		parked_add(-1);
+	}
+
+	return NULL;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline __attribute__((always_inline)) void decr_sleepers()
+// The thread is done with a directory, including all its subdirectories queued so far.
+// Once nothing is left queued or being processed anywhere, the main thread is woken up - the show is over.
+static inline __attribute__((always_inline)) void dirlist_retire()
 {
-#     if defined(PR_ATOMIC_ADD)
-        PR_ATOMIC_ADD(&sleeping_thread_cnt, -1);
+	if (outstanding_add(-1))
+		return;
+#     if ! defined(__APPLE__)
+	sem_post(&master_sem);
 #     else
-	pthread_mutex_lock(&sleeping_thread_cnt_lock);
-	sleeping_thread_cnt--;
-	pthread_mutex_unlock(&sleeping_thread_cnt_lock);
+	dispatch_semaphore_signal(master_sem);
 #     endif
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline __attribute__((always_inline)) dirlist_t *dirlist_pull_dir()
+// Forget about the directory the thread has just finished. Done under the same lock as when it was pulled from the queue,
+// so that a checkpoint always finds every directory left to process either in a queue or in some thread's curnode.
+// With option --dev-threads, the thread is no longer busy on that file system, which may let a parked thread take
+// a directory held back by the limit.
+static inline __attribute__((always_inline)) void dirlist_done(
+	threadlocal_t *tl)
 {
-	dirlist_t *nextdir;
+	pthread_mutex_t *lock = ws_queue ? &tl->wsq_lock : &dirlist_lock;
 
-#     if ! defined(__APPLE__)
-	incr_sleepers();
-	if (sleeping_thread_cnt == thread_cnt)
-		sem_post(&master_sem);  // - wake up master and let it decide if the show is over
-	sem_wait(&threads_sem);
-	decr_sleepers();
-#     else // __APPLE__
-	incr_sleepers();
-        if (sleeping_thread_cnt == thread_cnt)
-                dispatch_semaphore_signal(master_sem);
-        dispatch_semaphore_wait(threads_sem, DISPATCH_TIME_FOREVER);
-	decr_sleepers();
-#     endif
-
-	// Invariant: There is at least one entry in the Q here:
-	if (lifo_queue) {
-		nextdir = lifodirlist_extract();
-	} else if (fifo_queue) {
-		nextdir = fifodirlist_extract();
-	} else if (ino_queue) {
-		nextdir = inodirlist_bintreeextract();
-	} else {
-		fprintf(stderr, "Queue type not implemented - bailing out.\n");
-		exit(1);
+	pthread_mutex_lock(lock);
+	tl->curnode = NULL;
+	if (tl->devq) {
+		devqueues[tl->devq - 1].busy--;
+		tl->devq = 0;
 	}
+	pthread_mutex_unlock(lock);
 
-	if (! nextdir)
-		return NULL;
-
-	return nextdir;
+	if (dev_threads && queuesize)
+		dirlist_unpark(1);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -372,60 +837,352 @@ static inline __attribute__((always_inline)) dirlist_t *dirlist_pull_dir()
 #if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 
 // The framework for this code is borrowed from the getdents(2) Linux man page.
-static void readdir_extreme(
-	unsigned fd,
-	char *buf,
-	unsigned buf_size,
+// Returns the next entry from the thread's getdents buffer at the current level of in-line processing,
+// refilling the buffer from fd when it is exhausted, or NULL when there is nothing more left.
+// The entries are handed out in place, without being copied.
+static inline __attribute__((always_inline)) kernel_dirent_t *readdir_extreme(
+	threadlocal_t *tl,
+	int fd,
 	char *dirpath,
 	unsigned *pos,
-	struct dirent *dent,
 	unsigned *returned)
 {
-	struct dirent *d;
+	dentsbuf_t *db = &tl->dentsbuf[tl->dents_level - 1];
+	kernel_dirent_t *d;
+	int rc;
 
-#if defined (__OpenBSD__)
-	start:
-#endif
-	if (*pos == *returned) {
-		getdents_calls++;
-#	      if defined(__linux__)
-		*returned = syscall(SYS_getdents, fd, buf, buf_size);
-#	      else
-		*returned = getdents(fd, buf, buf_size);
+	while (TRUE) {
+		if (*pos >= *returned) {
+			unsigned long long t0 = metaop_start(tl);
+			tl->stats.getdents_calls++;
+#		      if defined(__linux__)
+			rc = syscall(SYS_getdents64, fd, db->buf, db->want);
+#		      else
+			rc = getdents(fd, db->buf, db->want);
+#		      endif
+			metaop_end(tl, t0);
+			if (rc < 0) {
+				//perror("getdents()");
+				fprintf(stderr, "%s: Unable to read directory %s\n", progname, dirpath);
+				*returned = 0;
+				return NULL;
+			}
+
+			if (rc == 0) // - nothing more left
+				return NULL;
+			*returned = rc;
+			*pos = 0;
+		}
+		d = (kernel_dirent_t *) (db->buf + *pos);
+		*pos += d->d_reclen;
+#	      if defined(__OpenBSD__)
+		if (! d->d_fileno) // - bogus entry
+			continue;
 #	      endif
-		if (*returned == -1) {
-			//perror("getdents()");
-			fprintf(stderr, "%s: Unable to read directory %s\n", progname, dirpath);
-			*returned = 0;
-			return;
+		return d;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Prepare the getdents buffer for the next level of in-line processing.
+// The read size is adapted to the directory size, so small directories don't need a big buffer,
+// while buf_size (DIRENTS) is the upper limit. The buffers are kept and reused for the rest of the run.
+static inline __attribute__((always_inline)) void readdir_extreme_enter(
+	threadlocal_t *tl,
+	off_t st_size)
+{
+	dentsbuf_t *db;
+	off_t want = st_size * 2; // - kernel records are usually bigger than the on-disk ones
+
+	if (want < DENTS_MIN_SIZE)
+		want = DENTS_MIN_SIZE;
+	if (want > buf_size)
+		want = buf_size;
+
+	if (tl->dents_level == tl->dents_levels) {
+		tl->dentsbuf = realloc(tl->dentsbuf, (tl->dents_levels + 1) * sizeof(dentsbuf_t));
+		assert(tl->dentsbuf);
+		tl->dentsbuf[tl->dents_levels].buf = NULL;
+		tl->dentsbuf[tl->dents_levels].size = 0;
+		tl->dents_levels++;
+	}
+	db = &tl->dentsbuf[tl->dents_level++]; // - the level is left again at the end of walk_dir()
+	if (want > db->size) {
+		free(db->buf);
+		db->buf = malloc(want);
+		assert(db->buf);
+		db->size = want;
+	}
+	db->want = want;
+}
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Take the entry buffer for the next level of in-line processing (options -O and --io-uring).
+// The buffers are kept and reused for the rest of the run, and the level is left again at the end of walk_dir().
+static inline __attribute__((always_inline)) void entbuf_enter(
+	threadlocal_t *tl)
+{
+	if (tl->ent_level == tl->ent_levels) {
+		tl->entbuf = realloc(tl->entbuf, (tl->ent_levels + 1) * sizeof(entbuf_t));
+		assert(tl->entbuf);
+		memset(&tl->entbuf[tl->ent_levels], 0, sizeof(entbuf_t));
+		tl->ent_levels++;
+	}
+	tl->ent_level++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) void entbuf_leave(
+	threadlocal_t *tl)
+{
+	entbuf_t *ib = &tl->entbuf[--tl->ent_level];
+
+	ib->cnt = 0; // - anything left over was not handled, due to a stop
+	ib->names_len = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Buffer an entry of the current directory, to be handled in inode order, or stat'ed ahead.
+// Returns TRUE when entbuf_chunk entries have been buffered, and they should be handled before reading any more.
+static inline __attribute__((always_inline)) boolean entbuf_add(
+	threadlocal_t *tl,
+	const char *name,
+	unsigned char d_type,
+	unsigned long long ino)
+{
+	entbuf_t *ib = &tl->entbuf[tl->ent_level - 1];
+	unsigned len = strlen(name) + 1;
+
+	if (ib->cnt == ib->size) {
+		ib->size = ib->size ? ib->size * 2 : INODE_ORDER_MIN;
+		ib->ents = realloc(ib->ents, ib->size * sizeof(inoent_t));
+		ib->tmp = realloc(ib->tmp, ib->size * sizeof(inoent_t));
+		assert(ib->ents && ib->tmp);
+	}
+	if (ib->names_len + len + 1 > ib->names_size) {
+		while (ib->names_len + len + 1 > ib->names_size)
+			ib->names_size = ib->names_size ? ib->names_size * 2 : INODE_ORDER_MIN * 16;
+		ib->names = realloc(ib->names, ib->names_size);
+		assert(ib->names);
+	}
+	ib->ents[ib->cnt].ino = ino;
+	ib->ents[ib->cnt].name = ib->names_len;
+	ib->names[ib->names_len++] = d_type;
+	memcpy(ib->names + ib->names_len, name, len);
+	ib->names_len += len;
+	return ++ib->cnt == entbuf_chunk;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Sort the buffered entries on inode number, with an LSD radix sort on one byte at a time.
+// The counts for all bytes are made in one pass, and a byte that is the same for all entries
+// (typically the high bytes of the inode numbers) is skipped. Small chunks get an insertion sort.
+static inline __attribute__((always_inline)) void inode_sort(
+	entbuf_t *ib)
+{
+	unsigned count[sizeof(ib->ents->ino)][256];
+	inoent_t *from = ib->ents, *to = ib->tmp, *t, e;
+	unsigned n = ib->cnt, i, j, b, sum, c;
+
+	if (n < 64) {
+		for (i = 1; i < n; i++) {
+			e = from[i];
+			for (j = i; j > 0 && from[j - 1].ino > e.ino; j--)
+				from[j] = from[j - 1];
+			from[j] = e;
 		}
+		return;
+	}
 
-		if (*returned == 0) // - nothing more left
-			return;
-		*pos = 0;
-	}
-	d = (struct dirent *) (buf + *pos);
-	//dent->d_ino = d->d_ino;
-	//dent->d_reclen = d->d_reclen;
-#     if defined(__linux__)
-	dent->d_type = *(buf + *pos + d->d_reclen-1);
-	strcpy(dent->d_name, d->d_name-1);
-#     elif defined(__OpenBSD__)
-	if (! d->d_fileno) { // - bogus entry
-		*pos += d->d_reclen;
-		goto start;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		for (b = 0; b < sizeof(from->ino); b++)
+			count[b][(from[i].ino >> (b * 8)) & 0xff]++;
+
+	for (b = 0; b < sizeof(from->ino); b++) {
+		if (count[b][(from[0].ino >> (b * 8)) & 0xff] == n)
+			continue; // - all entries have the same byte here
+		for (sum = 0, i = 0; i < 256; i++) {
+			c = count[b][i];
+			count[b][i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			to[count[b][(from[i].ino >> (b * 8)) & 0xff]++] = from[i];
+		t = from;
+		from = to;
+		to = t;
 	}
-	dent->d_type = d->d_type;
-	//printf("<%s> (%i)\n", d->d_name, d->d_fileno);
-	strcpy(dent->d_name, d->d_name);
-#     else
-	dent->d_type = d->d_type;
-	strcpy(dent->d_name, d->d_name);
-#     endif
-	*pos += d->d_reclen;
-	return;
+
+	// - The sorted entries end up in the scratch buffer after an odd number of passes, so just swap the two.
+	if (from != ib->ents) {
+		ib->tmp = ib->ents;
+		ib->ents = from;
+	}
+}
+
+#if defined(HAVE_IO_URING)
+/////////////////////////////////////////////////////////////////////////////
+
+// Set up an io_uring instance with room for entries requests, and check that it supports statx and openat.
+// Returns FALSE if the kernel is too old, or io_uring is disabled (e.g. by the kernel.io_uring_disabled sysctl or seccomp).
+static boolean uring_setup(
+	uring_t *u,
+	unsigned entries)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	boolean supported;
+
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = syscall(SYS_io_uring_setup, entries, &p)) < 0)
+		return FALSE;
+
+	probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	assert(probe);
+	supported = syscall(SYS_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& probe->last_op >= IORING_OP_STATX && probe->last_op >= IORING_OP_OPENAT
+		&& (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)
+		&& (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (! supported) {
+		close(u->fd);
+		return FALSE;
+	}
+
+	u->entries = p.sq_entries;
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) { // - both rings in one mapping, since Linux 5.4
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = 0;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ptr = u->cq_len ? mmap(NULL, u->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING) : u->sq_ptr;
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+		if (u->sq_ptr != MAP_FAILED)
+			munmap(u->sq_ptr, u->sq_len);
+		if (u->cq_len && u->cq_ptr != MAP_FAILED)
+			munmap(u->cq_ptr, u->cq_len);
+		if (u->sqes != MAP_FAILED)
+			munmap(u->sqes, u->sqes_len);
+		close(u->fd);
+		return FALSE;
+	}
+
+	u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+	u->inflight = 0;
+	u->unsubmitted = 0;
+	return TRUE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static void uring_teardown(
+	uring_t *u)
+{
+	if (u->state != URING_READY)
+		return;
+	munmap(u->sqes, u->sqes_len);
+	if (u->cq_len)
+		munmap(u->cq_ptr, u->cq_len);
+	munmap(u->sq_ptr, u->sq_len);
+	close(u->fd);
+	u->state = URING_UNTRIED;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Get the next free submission queue entry, cleared, or NULL if the ring is full.
+// It is handed to the kernel by the next uring_enter(), once uring_commit() has been called.
+static inline __attribute__((always_inline)) struct io_uring_sqe *uring_get_sqe(
+	uring_t *u)
+{
+	unsigned tail = *u->sq_tail, idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail - *(volatile unsigned *)u->sq_head >= u->entries)
+		return NULL;
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	return sqe;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+
+static inline __attribute__((always_inline)) void uring_commit(
+	uring_t *u)
+{
+	__sync_synchronize(); // - the entry is filled in before the kernel can see the new tail
+	*(volatile unsigned *)u->sq_tail = *u->sq_tail + 1;
+	u->unsubmitted++;
+	u->inflight++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Hand the new requests to the kernel, and with wait set, also wait for at least one completion.
+static inline __attribute__((always_inline)) void uring_enter(
+	uring_t *u,
+	boolean wait)
+{
+	int rc = syscall(SYS_io_uring_enter, u->fd, u->unsubmitted, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	if (rc >= 0)
+		u->unsubmitted -= rc;
+	else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		// - The requests in flight point into memory the kernel may still write to, so there is no safe way on.
+		pthread_mutex_lock(&perror_lock);
+		perror("io_uring_enter()");
+		pthread_mutex_unlock(&perror_lock);
+		exit(1);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Move the results of all completed requests to their prefetch slots. The low bit of user_data tells an openat from a statx.
+// This may also be done by a deeper level of in-line processing, for requests made by the levels above.
+static inline __attribute__((always_inline)) void uring_reap(
+	uring_t *u)
+{
+	unsigned head = *u->cq_head, tail = *(volatile unsigned *)u->cq_tail;
+	struct io_uring_cqe *cqe;
+	prefetch_t *pf;
+
+	__sync_synchronize(); // - the completions are read after the tail
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & *u->cq_mask];
+		pf = (prefetch_t *)(unsigned long)(cqe->user_data & ~1ULL);
+		if (cqe->user_data & 1)
+			pf->open_res = cqe->res;
+		else
+			pf->stat_res = cqe->res;
+		pf->pending--;
+		u->inflight--;
+	}
+	__sync_synchronize(); // - the completions are read before the kernel may reuse them
+	*(volatile unsigned *)u->cq_head = head;
+}
 #endif
 
 /////////////////////////////////////////////////////////////////////////////
@@ -445,13 +1202,7 @@ static inline __attribute__((always_inline)) time_t get_mtime(
                 pthread_mutex_unlock(&perror_lock);
 	}
 
-#     if defined(PR_ATOMIC_ADD)
-        PR_ATOMIC_ADD(&statcount, 1);
-#     else
-        pthread_mutex_lock(&statcount_lock);
-        statcount++;
-        pthread_mutex_unlock(&statcount_lock);
-#     endif
+	((threadlocal_t *)pthread_getspecific(threadlocal_key))->stats.statcount++;
 
 	return st.st_mtime;
 }
@@ -472,20 +1223,26 @@ static char *gettime() {
 
 static void traverse_trees(
 	char **dirpaths,
-	int dirpathcount)
+	int dirpathcount,
+	const unsigned *depths) // - depth of each of dirpaths when resuming from a checkpoint, NULL for start points
 {
 	int rc = 0, i;
 	struct stat st;
 	int verified_startdircount = dirpathcount;
 
+	// - The main thread holds a unit of work of its own while queueing the start points,
+	// so the count of outstanding directories can't drop to zero before they are all queued.
+	(void) outstanding_add(1);
+
 	for (i = 0; i < dirpathcount; i++) {
 		if (! dirpaths[i]) {
 			verified_startdircount--;
 			continue;
 		}
 
-		rc = stat(dirpaths[i], &st);
-		statcount++;
+		// - Symlinks are only followed for the start points themselves.
+		rc = depths && depths[i] > 1 ? lstat(dirpaths[i], &st) : stat(dirpaths[i], &st);
+		threadlocal_arr[thread_cnt].stats.statcount++; // - the main thread's counters
 		if (rc) {
 			errno = ENOENT;
 			fprintf(stderr, "%s: ", progname);
@@ -503,37 +1260,13 @@ static void traverse_trees(
 			continue;
 		}
 
-#	      if defined(__sun__)
-		struct statvfs stfs;
-		if (statvfs(dirpaths[i], &stfs) < 0) {
-			fprintf(stderr, "%s: ", progname);
-			perror("statfs()");
-			return;
-		}
-		if (strcmp(stfs.f_basetype, "hsfs") == 0
-			|| strcmp(stfs.f_basetype, "udfs") == 0
-			|| strcmp(stfs.f_basetype, "proc") == 0)
-				simulate_posix_compliance = TRUE;
-		// Solaris file system is assumed to be POSIX compliant if fstype != hsfs && fstype != udfs && fstype != proc
-
-		if (debug)
-			fprintf(stderr, "FStype(%s) = %s, POSIX compliance = %s\n",
-				dirpaths[i], stfs.f_basetype, simulate_posix_compliance ? "FALSE" : "TRUE");
-#	      endif
-
-		if (st.st_nlink < 2) // - assumed to be the case for btrfs, fuse, ntfs, fat
-			simulate_posix_compliance = TRUE;
+		if (! devfs_posix(st.st_dev, dirpaths[i]))
+			st.st_nlink = DIRTY_CONSTANT;
+		// - a link count below 2 is assumed to be the case for btrfs, fuse, ntfs, fat, and is caught by walk_dir()
 
-#	      if defined(_AIX)
-		if (debug)
-			fprintf(stderr, "Startdir: %s, POSIX compliance = %s\n",
-				dirpaths[i], simulate_posix_compliance ? "FALSE" : "TRUE");
-		// - for AIX, see /usr/include/sys/vmount.h for supported f_vfstype
-#	      else
 		if (debug)
 			fprintf(stderr, "%s, POSIX compliance = %s\n",
-				dirpaths[i], simulate_posix_compliance ? "FALSE" : "TRUE");
-#	      endif
+				dirpaths[i], st.st_nlink == (nlink_t)DIRTY_CONSTANT || st.st_nlink < 2 ? "FALSE" : "TRUE");
 
 		//char *rind = rindex(dirpaths[i], '/');
 		size_t slen = strlen(dirpaths[i]);
@@ -542,18 +1275,29 @@ static void traverse_trees(
 			*rightmost = '\0';
 			rightmost--;
 		}
-		dirlist_add_dir(dirpaths[i], 1, &st);
+		dirlist_add_dir(NULL, dirpaths[i], strlen(dirpaths[i]), depths ? depths[i] : 1, &st);
 	}
 
 #     if defined(RMTREE) || defined(CHMODTREE) || defined(CHOWNTREE)
+#     if defined(CHOWNTREE)
+        if (! verified_startdircount && ! resume_batch_count) {
+#     else
         if (! verified_startdircount) {
+#     endif
                 fprintf(stderr, "No valid path given - bailing out!\n");
                 exit(1);
         }
 #     endif
 
-	do {
-#             if ! defined(__APPLE__)
+	dirlist_retire(); // - all the start points are queued, so the main thread lets go of its own unit of work
+	while (outstanding_dirs) {
+#             if defined(CHOWNTREE)
+		master_wait(); // - also takes care of checkpoints and the deadline
+		if (stop_requested) {
+			stopping = TRUE;
+			break;
+		}
+#             elif ! defined(__APPLE__)
 		sem_wait(&master_sem);
 #             else
 		dispatch_semaphore_wait(master_sem, DISPATCH_TIME_FOREVER);
@@ -561,21 +1305,9 @@ static void traverse_trees(
 
 #	     if defined(DEBUG3)
 		if (getenv("DEBUG3"))
-			fprintf(stderr, "traverse_trees(): MASTER woken up - sleepers = %i\n", sleeping_thread_cnt);
+			fprintf(stderr, "traverse_trees(): MASTER woken up - outstanding = %u, parked = %u\n", outstanding_dirs, parked_thread_cnt);
 #	     endif
-		pthread_mutex_lock(&sem_val_max_exceeded_cnt_lock);
-		while (sem_val_max_exceeded_cnt) {
-#                     if ! defined(__APPLE__)
-			if (sem_post(&threads_sem))
-				break;
-#		      else
-                        if (dispatch_semaphore_signal(threads_sem) == 0)
-                                break;
-#		      endif
-			sem_val_max_exceeded_cnt--;
-		}
-		pthread_mutex_unlock(&sem_val_max_exceeded_cnt_lock);
-	} while (queuesize > 0 || sleeping_thread_cnt < thread_cnt);
+	}
 
 #     if defined(RMTREE)
         if (! dryrun) {
@@ -598,10 +1330,10 @@ static void traverse_trees(
 			if (getenv("DEBUG3"))
                         	fprintf(stderr, "traverse_trees() - running FINAL dirlist_add_dir()\n");
 #		      endif
-                        dirlist_add_dir(dirpaths[i], 1, &st);
+                        dirlist_add_dir(NULL, dirpaths[i], strlen(dirpaths[i]), 1, &st);
                 }
 
-                while (queuesize > 0 || sleeping_thread_cnt < thread_cnt) {
+                while (outstanding_dirs) {
 #                     if ! defined(__APPLE__)
                         sem_wait(&master_sem);
 #                     else
@@ -610,35 +1342,23 @@ static void traverse_trees(
 
 #            if defined(DEBUG3)
                         if (getenv("DEBUG3"))
-                                fprintf(stderr, "traverse_trees(): MASTER woken up - sleepers = %i\n", sleeping_thread_cnt);
+                                fprintf(stderr, "traverse_trees(): MASTER woken up - outstanding = %u, parked = %u\n", outstanding_dirs, parked_thread_cnt);
 #            endif
-                        pthread_mutex_lock(&sem_val_max_exceeded_cnt_lock);
-                        while (sem_val_max_exceeded_cnt) {
-#			      if ! defined(__APPLE__)
-                                if (sem_post(&threads_sem))
-                                        break;
-#			      else
-				if (dispatch_semaphore_signal(threads_sem) == 0)
-					break;
-#			      endif
-                                sem_val_max_exceeded_cnt--;
-                        }
-                        pthread_mutex_unlock(&sem_val_max_exceeded_cnt_lock);
                 }
         }
 #     endif
 
+#     if defined(CHOWNTREE)
+	run_end_usec = run_usec();
+#     endif
 	master_finished = TRUE;
 	if (debug)
 		fprintf(stderr, "traverse_trees() - MASTER loop FINISHED\n");
 
-	for (i = 0; i < thread_cnt; i++) {
-#if ! defined(__APPLE__)
-		sem_post(&threads_sem);
-#else
-		dispatch_semaphore_signal(threads_sem);
-#endif
-	}
+	dirlist_unpark(INT_MAX);
+#     if defined(CHOWNTREE)
+	active_threads_set(thread_cnt); // - and the throttled ones (option -t auto)
+#     endif
 
 	if (debug)
 		fprintf(stderr, "traverse_trees() - waiting for threads to finish\n");
@@ -711,7 +1431,7 @@ static void traverse_trees(
 
 /////////////////////////////////////////////////////////////////////////////
 
-static void walk_dir(dirlist_t *); // - used by pthread_routine()
+static void walk_dir(threadlocal_t *, dirlist_t *); // - used by pthread_routine()
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -720,10 +1440,17 @@ static void *pthread_routine(
 	void *id) // - has to be void *
 {
 	dirlist_t *curdir;
+	threadlocal_t *tl = &threadlocal_arr[(unsigned long)id];
+
+	pthread_setspecific(threadlocal_key, tl);
 
 	do {
-		if ((curdir = dirlist_pull_dir())) {
-			walk_dir(curdir);
+		if ((curdir = dirlist_pull_dir(tl))) {
+			walk_dir(tl, curdir);
+			if (stopping) {
+				dirlist_done(tl); // - walk_dir() has saved where it left curdir for the final checkpoint
+				break;
+			}
 #		      if defined(SRCH)
 			if (summarize_diskusage && curdir->du) {
 #			      if defined(PR_ATOMIC_ADD)
@@ -735,6 +1462,7 @@ static void *pthread_routine(
 #			      endif
 			}
 #		      endif
+#		      if ! defined(CHOWNTREE) // - chowntree counts entries per thread, and the main thread reports progress (option -v)
 			if (just_count || verbose_count) {
 #                             if defined(PR_ATOMIC_ADD)
 				PR_ATOMIC_ADD(&accum_filecnt, curdir->filecnt);
@@ -762,9 +1490,13 @@ static void *pthread_routine(
 					pthread_mutex_unlock(&last_accum_filecnt_lock);
 				}
 			}
-			free(curdir);
+#		      endif
+			if (checkpoint_file || dev_threads)
+				dirlist_done(tl);
+			dirlist_free(tl, curdir);
+			dirlist_retire();
 		}
-	} while (! master_finished);
+	} while (! master_finished && ! stopping);
 
 #     if ! defined(__APPLE__)
 	sem_post(&finished_threads_sem);
@@ -791,16 +1523,38 @@ static void thread_prepare()
 	thread_arr = calloc(thread_cnt, sizeof(pthread_t));
 	assert(thread_arr);
 
+	// One entry per worker thread plus one for the main thread, and one per chown thread (option --chown-threads),
+	// each on its own cache line(s):
+	threadlocal_mem = calloc(1, (thread_cnt + 1 + chown_threads) * sizeof(threadlocal_t) + CACHELINE_SIZE);
+	assert(threadlocal_mem);
+	threadlocal_arr = (threadlocal_t *)(((unsigned long)threadlocal_mem + CACHELINE_SIZE - 1) & ~(unsigned long)(CACHELINE_SIZE - 1));
+	for (i = 0; i <= thread_cnt + chown_threads; i++) {
+		threadlocal_arr[i].idx = i;
+		rc = pthread_mutex_init(&threadlocal_arr[i].wsq_lock, NULL);
+		assert(rc == 0);
+		threadlocal_arr[i].pathbuf_size = PATHBUF_SIZE;
+		threadlocal_arr[i].pathbuf = malloc(PATHBUF_SIZE);
+		assert(threadlocal_arr[i].pathbuf);
+#	      if defined(CHOWNTREE)
+		if (map_file) {
+			// - Not freed by thread_cleanup(), since the hits are reported after it (option -S).
+			threadlocal_arr[i].map_hits = calloc(uid_map.count + gid_map.count, sizeof(unsigned long long));
+			assert(threadlocal_arr[i].map_hits);
+		}
+#	      endif
+	}
+	rc = pthread_key_create(&threadlocal_key, NULL);
+	assert(rc == 0);
+	pthread_setspecific(threadlocal_key, &threadlocal_arr[thread_cnt]);
+
 #if ! defined(__APPLE__)
 	int rc1 = sem_init(&master_sem, 0, 0);
-	int rc2 = sem_init(&threads_sem, 0, 0);
-	int rc3 = sem_init(&finished_threads_sem, 0, 0);
-	assert(! rc1 && ! rc2 && ! rc3);
+	int rc2 = sem_init(&finished_threads_sem, 0, 0);
+	assert(! rc1 && ! rc2);
 #else
 	master_sem = dispatch_semaphore_create(0);
-	threads_sem = dispatch_semaphore_create(0);
 	finished_threads_sem = dispatch_semaphore_create(0);
-	assert(master_sem && threads_sem && finished_threads_sem);
+	assert(master_sem && finished_threads_sem);
 #endif
 
 	pthread_attr_t attr;
@@ -814,14 +1568,27 @@ static void thread_prepare()
 
 /////////////////////////////////////////////////////////////////////////////
 
+static void exclude_trie_free(
+	exclude_node_t *node)
+{
+	unsigned i;
+
+	for (i = 0; i < node->child_count; i++)
+		exclude_trie_free(&node->children[i]);
+	free(node->children);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
 static void thread_cleanup()
 {
 	int i;
+	unsigned j;
 
 	if (debug)
 		fprintf(stderr, "START thread_cleanup()\n");
 
-#     if ! defined(PR_ATOMIC_ADD)
+#     if ! defined(PR_ATOMIC_ADD) && ! defined(CHOWNTREE)
 	pthread_mutex_destroy(&accum_filecnt_lock);
 #     endif
 	pthread_mutex_destroy(&perror_lock);
@@ -838,16 +1605,52 @@ static void thread_cleanup()
 
 	free(thread_arr);
 
-	if (excludelist_count)
-		free(excludelist);
-
-	if (excluderecomp) {
-		for (i = 0; i < excludelist_count; i++) {
-			regfree(excluderecomp[i]);
-			free(excluderecomp[i]);
+	for (i = 0; i <= thread_cnt + chown_threads; i++) {
+		pthread_mutex_destroy(&threadlocal_arr[i].wsq_lock);
+		free(threadlocal_arr[i].pathbuf);
+		free(threadlocal_arr[i].stopbuf.buf);
+		for (j = 0; j < threadlocal_arr[i].ent_levels; j++) {
+			if (threadlocal_arr[i].entbuf[j].pf) {
+				unsigned k;
+				for (k = 0; k < uring_depth; k++)
+					free(threadlocal_arr[i].entbuf[j].pf[k].path);
+				free(threadlocal_arr[i].entbuf[j].pf);
+			}
+			free(threadlocal_arr[i].entbuf[j].ents);
+			free(threadlocal_arr[i].entbuf[j].tmp);
+			free(threadlocal_arr[i].entbuf[j].names);
 		}
-		free(excluderecomp);
+		free(threadlocal_arr[i].entbuf);
+#	      if defined(HAVE_IO_URING)
+		uring_teardown(&threadlocal_arr[i].uring);
+#	      endif
+#	      if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+		unsigned l;
+		for (l = 0; l < threadlocal_arr[i].dents_levels; l++)
+			free(threadlocal_arr[i].dentsbuf[l].buf);
+		free(threadlocal_arr[i].dentsbuf);
+#	      endif
+	}
+
+	for (j = 0; j < exclude_names_count; j++)
+		free(exclude_names[j]);
+	free(exclude_names);
+	free(exclude_name_set);
+	for (j = 0; j < exclude_patterns_count; j++) {
+		regfree(exclude_recomps[j]);
+		free(exclude_recomps[j]);
+		free(exclude_patterns[j]);
+	}
+	free(exclude_recomps);
+	free(exclude_patterns);
+	if (exclude_regex) {
+		regfree(exclude_regex);
+		free(exclude_regex);
 	}
+	exclude_trie_free(&exclude_trie);
+	for (j = 0; j < exclude_paths_count; j++)
+		free(exclude_paths[j]);
+	free(exclude_paths);
 
 #     if defined(SRCH)
 	if (regex_opt) {
@@ -858,11 +1661,9 @@ static void thread_cleanup()
 #     endif
 
 #if ! defined(__APPLE__)
-	sem_destroy(&threads_sem);
 	sem_destroy(&master_sem);
 	sem_destroy(&finished_threads_sem);
 #else
-	dispatch_release(threads_sem);
 	dispatch_release(master_sem);
 	dispatch_release(finished_threads_sem);
 #endif